@@ -0,0 +1,154 @@
+/*
+** arena.c
+**
+** Simple bump allocator. Memory is handed out from a chain of blocks
+** and is only released all at once, by arena_reset() (which keeps the
+** blocks for reuse) or arena_destroy().
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN  (sizeof(double) > sizeof(void *) ? sizeof(double) : sizeof(void *))
+#define ARENA_HDRLEN ((sizeof(ARENA_BLOCK)+ARENA_ALIGN-1) & ~(ARENA_ALIGN-1))
+
+
+ARENA *
+arena_create(size_t bsize)
+{
+    ARENA *ap;
+
+    
+    ap = malloc(sizeof(*ap));
+    if (!ap)
+	return NULL;
+
+    memset(ap, 0, sizeof(*ap));
+    ap->bsize = bsize ? bsize : 65536;
+    return ap;
+}
+
+
+static ARENA_BLOCK *
+arena_block(ARENA *ap,
+	    size_t size)
+{
+    ARENA_BLOCK *bp;
+    
+
+    /* Reuse blocks kept by arena_reset() */
+    while (ap->cur && ap->cur->next)
+    {
+	bp = ap->cur->next;
+	bp->used = 0;
+	ap->cur = bp;
+	if (bp->size >= size)
+	    return bp;
+    }
+    
+    if (size < ap->bsize)
+	size = ap->bsize;
+    
+    bp = malloc(ARENA_HDRLEN + size);
+    if (!bp)
+	return NULL;
+
+    bp->next = NULL;
+    bp->size = size;
+    bp->used = 0;
+
+    if (ap->cur)
+	ap->cur->next = bp;
+    else
+	ap->head = bp;
+    ap->cur = bp;
+    
+    return bp;
+}
+
+
+static void *
+arena_get(ARENA *ap,
+	  size_t size,
+	  size_t align)
+{
+    ARENA_BLOCK *bp = ap->cur;
+    size_t off;
+    
+
+    off = bp ? (bp->used + align-1) & ~(align-1) : 0;
+    if (!bp || off + size > bp->size)
+    {
+	bp = arena_block(ap, size);
+	if (!bp)
+	    return NULL;
+	off = 0;
+    }
+
+    bp->used = off + size;
+    ap->total += size;
+    
+    return (char *) bp + ARENA_HDRLEN + off;
+}
+
+
+void *
+arena_alloc(ARENA *ap,
+	    size_t size)
+{
+    return arena_get(ap, size ? size : 1, ARENA_ALIGN);
+}
+
+
+char *
+arena_strdup(ARENA *ap,
+	     const char *s)
+{
+    size_t len = strlen(s)+1;
+    char *d;
+
+    
+    d = arena_get(ap, len, 1);
+    if (d)
+	memcpy(d, s, len);
+    
+    return d;
+}
+
+
+size_t
+arena_used(ARENA *ap)
+{
+    return ap->total;
+}
+
+
+void
+arena_reset(ARENA *ap)
+{
+    ap->cur = ap->head;
+    if (ap->cur)
+	ap->cur->used = 0;
+    ap->total = 0;
+}
+
+
+void
+arena_destroy(ARENA *ap)
+{
+    ARENA_BLOCK *bp, *next;
+
+    
+    if (!ap)
+	return;
+    
+    for (bp = ap->head; bp; bp = next)
+    {
+	next = bp->next;
+	free(bp);
+    }
+    free(ap);
+}
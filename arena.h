@@ -0,0 +1,46 @@
+/*
+** arena.h
+*/
+
+#ifndef PTMS_ARENA_H
+#define PTMS_ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+} ARENA_BLOCK;
+
+typedef struct
+{
+    ARENA_BLOCK *head;
+    ARENA_BLOCK *cur;
+    size_t bsize;
+    size_t total;
+} ARENA;
+
+
+extern ARENA *
+arena_create(size_t bsize);
+
+extern void *
+arena_alloc(ARENA *ap,
+	    size_t size);
+
+extern char *
+arena_strdup(ARENA *ap,
+	     const char *s);
+
+extern size_t
+arena_used(ARENA *ap);
+
+extern void
+arena_reset(ARENA *ap);
+
+extern void
+arena_destroy(ARENA *ap);
+
+#endif
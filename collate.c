@@ -0,0 +1,289 @@
+/*
+** collate.c
+**
+** Collation of menu titles and table cells. Strings are not compared
+** with strcoll(), which is several times slower than strcmp(), but
+** turned into a key once each, and the keys compared with strcmp().
+**
+** PTMS_COLLATE chooses the collation: "sv" for the built-in Swedish
+** one, or the locale whose strxfrm() makes the keys. Without it the
+** locale of LC_ALL, LC_COLLATE or LANG is used, and in the C locale
+** strings are kept in byte order, with no keys made at all.
+**
+** The built-in key is the base letters (a-z, then å, ä and ö; other
+** accented Latin letters go with their base letter, æ and ø with ä
+** and ö, ü with y), the accents and the case of the string, as three
+** levels separated by 0x01 bytes, and then the string itself. Both
+** UTF-8 and Latin-1 text is understood.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <locale.h>
+
+#include "collate.h"
+
+
+#define COLLATE_BYTES	0
+#define COLLATE_LOCALE	1
+#define COLLATE_SV	2
+
+/* Primary weights of the built-in key, in sort order */
+#define SV_CONTROL	0x02
+#define SV_PUNCT	0x03	/* ASCII 0x20..0x7E */
+#define SV_SYMBOL	0x62	/* Latin-1 0x80..0xBF, then × and ÷ */
+#define SV_DIGIT	0xA4
+#define SV_LETTER	0xAE	/* a-z, å, ä, ö */
+#define SV_OTHER	0xF0	/* Followed by the code point */
+
+static int collation = COLLATE_BYTES;
+static const char *coll_name = "C";
+static unsigned int coll_id = 0;
+
+/* Base letters of U+00E0..U+00FF, '{', '|' and '}' (after 'z') being å, ä and ö */
+static const char sv_latin1[] = "aaaa|{|ceeeeiiiidnoooo} }uuuyyty";
+
+
+/*
+** Choose the collation, see above. Called once at startup.
+*/
+void
+collate_init(void)
+{
+    const char *cp, *lp;
+    uint32_t h;
+
+
+    cp = getenv("PTMS_COLLATE");
+    if (cp && strcmp(cp, "sv") == 0)
+    {
+	collation = COLLATE_SV;
+	coll_name = "sv";
+    }
+    else
+    {
+	lp = setlocale(LC_COLLATE, cp ? cp : "");
+	if (!lp)
+	{
+	    fprintf(stderr, "collate_init: %s: Unknown locale\n", cp ? cp : "");
+	    setlocale(LC_COLLATE, "C");
+	    return;
+	}
+	if (strcmp(lp, "C") == 0 || strcmp(lp, "POSIX") == 0 ||
+	    (coll_name = strdup(lp)) == NULL)
+	{
+	    coll_name = "C";
+	    return;
+	}
+	collation = COLLATE_LOCALE;
+    }
+
+    h = 2166136261U;
+    for (cp = coll_name; *cp; ++cp)
+	h = (h ^ (unsigned char) *cp) * 16777619U;
+    coll_id = h ? h : 1;
+}
+
+/* Name of the collation, "C" for byte order */
+const char *
+collate_name(void)
+{
+    return coll_name;
+}
+
+/*
+** Number standing for the collation in stored sort orders, or 0 for
+** byte order.
+*/
+unsigned int
+collate_id(void)
+{
+    return coll_id;
+}
+
+
+/* Next character of UTF-8 text, or Latin-1 where it is not UTF-8 */
+static unsigned int
+sv_char(const unsigned char **sp)
+{
+    const unsigned char *s = *sp;
+    unsigned int c = s[0];
+    int i, n;
+
+
+    if (c >= 0xC2 && c <= 0xDF)
+    {
+	n = 1;
+	c &= 0x1F;
+    }
+    else if (c >= 0xE0 && c <= 0xEF)
+    {
+	n = 2;
+	c &= 0x0F;
+    }
+    else if (c >= 0xF0 && c <= 0xF4)
+    {
+	n = 3;
+	c &= 0x07;
+    }
+    else
+	n = 0;
+
+    for (i = 1; i <= n && (s[i] & 0xC0) == 0x80; ++i)
+	c = (c << 6) | (s[i] & 0x3F);
+
+    if (i <= n)
+    {
+	*sp = s + 1;
+	return s[0];
+    }
+
+    *sp = s + n + 1;
+    return c;
+}
+
+/*
+** Weights of the character c: the primary ones in p[] (returning how
+** many), the accent in *sec and the case in *ter.
+*/
+static int
+sv_weights(unsigned int c,
+	   unsigned char *p,
+	   unsigned char *sec,
+	   unsigned char *ter)
+{
+    *sec = 0x02;
+    *ter = 0x02;
+
+    if (c == 0xD7 || c == 0xF7)
+    {
+	p[0] = SV_SYMBOL + 0x40 + (c == 0xF7);
+	return 1;
+    }
+
+    if ((c >= 'A' && c <= 'Z') || (c >= 0xC0 && c <= 0xDE))
+    {
+	c += 0x20;
+	*ter = 0x03;
+    }
+
+    if (c >= 'a' && c <= 'z')
+	p[0] = SV_LETTER + c - 'a';
+    else if (c >= '0' && c <= '9')
+	p[0] = SV_DIGIT + c - '0';
+    else if (c < 0x20 || c == 0x7F)
+	p[0] = SV_CONTROL;
+    else if (c < 0x80)
+	p[0] = SV_PUNCT + c - 0x20;
+    else if (c < 0xC0)
+	p[0] = SV_SYMBOL + c - 0x80;
+    else if (c == 0xDF)
+    {
+	/* ß as ss */
+	p[0] = p[1] = SV_LETTER + 's' - 'a';
+	*sec = 0x03;
+	return 2;
+    }
+    else if (c <= 0xFF)
+    {
+	p[0] = SV_LETTER + sv_latin1[c - 0xE0] - 'a';
+	if (c != 0xE4 && c != 0xE5 && c != 0xF6)
+	    *sec = 0x03 + c - 0xE0;
+    }
+    else
+    {
+	p[0] = SV_OTHER;
+	p[1] = ((c >> 14) & 0x7F) + 1;
+	p[2] = ((c >> 7) & 0x7F) + 1;
+	p[3] = (c & 0x7F) + 1;
+	return 4;
+    }
+
+    return 1;
+}
+
+static size_t
+sv_xfrm(char *dst,
+	const char *src,
+	size_t size)
+{
+    const unsigned char *s;
+    unsigned char p[4], sec, ter;
+    unsigned int c;
+    size_t n = 0;
+    int i, k, level;
+
+
+#define PUT(b)	do { if (n < size) dst[n] = (b); ++n; } while (0)
+
+    for (level = 0; level < 3; ++level)
+    {
+	for (s = (const unsigned char *) src; *s; )
+	{
+	    c = sv_char(&s);
+	    k = sv_weights(c, p, &sec, &ter);
+	    if (level == 0)
+		for (i = 0; i < k; ++i)
+		    PUT(p[i]);
+	    else
+		PUT(level == 1 ? sec : ter);
+	}
+	PUT(0x01);
+    }
+
+    /* Strings that only differ in what the levels ignore */
+    for (s = (const unsigned char *) src; *s; ++s)
+	PUT(*s);
+
+#undef PUT
+
+    if (n < size)
+	dst[n] = '\0';
+    return n;
+}
+
+
+/*
+** Like strxfrm(): the key of src into dst, if it has room for it and
+** the NUL. Returns the length of the key.
+*/
+size_t
+collate_xfrm(char *dst,
+	     const char *src,
+	     size_t size)
+{
+    size_t n;
+
+
+    switch (collation)
+    {
+      case COLLATE_SV:
+	return sv_xfrm(dst, src, size);
+
+      case COLLATE_LOCALE:
+	return strxfrm(dst, src, size);
+
+      default:
+	n = strlen(src);
+	if (n < size)
+	    memcpy(dst, src, n + 1);
+	return n;
+    }
+}
+
+/* The key of s, malloc()ed, or NULL */
+char *
+collate_key(const char *s)
+{
+    char *key;
+    size_t n;
+
+
+    n = collate_xfrm(NULL, s, 0);
+    key = malloc(n + 1);
+    if (key)
+	collate_xfrm(key, s, n + 1);
+    return key;
+}
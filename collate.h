@@ -0,0 +1,27 @@
+/*
+** collate.h
+*/
+
+#ifndef PTMS_COLLATE_H
+#define PTMS_COLLATE_H
+
+#include <stddef.h>
+
+extern void
+collate_init(void);
+
+extern const char *
+collate_name(void);
+
+extern unsigned int
+collate_id(void);
+
+extern size_t
+collate_xfrm(char *dst,
+	     const char *src,
+	     size_t size);
+
+extern char *
+collate_key(const char *s);
+
+#endif
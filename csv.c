@@ -6,6 +6,13 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <alloca.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "csv.h"
 
@@ -419,6 +426,368 @@ csv_geti(int *ip,
 
 
 
+/*
+** Map a whole file for csv_field(). The mapping is private and
+** writable so that quoted fields can be unquoted in place. Files
+** that cannot be mapped (pipes and such) are read into memory.
+*/
+CSVMAP *
+csv_map(const char *path)
+{
+  CSVMAP *mp;
+  struct stat sb;
+  char *nbuf;
+  size_t size = 0;
+  ssize_t rc;
+  int fd;
+
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  mp = malloc(sizeof(*mp));
+  if (!mp)
+  {
+    close(fd);
+    return NULL;
+  }
+  memset(mp, 0, sizeof(*mp));
+  mp->fd = -1;
+
+  if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode))
+  {
+    mp->st = sb;
+    if (sb.st_size == 0)
+    {
+      close(fd);
+      return mp;
+    }
+
+    mp->buf = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mp->buf != MAP_FAILED)
+    {
+      mp->len = sb.st_size;
+      mp->mapped = 1;
+      madvise(mp->buf, mp->len, MADV_SEQUENTIAL);
+      close(fd);
+      return mp;
+    }
+    mp->buf = NULL;
+  }
+
+  for (;;)
+  {
+    if (mp->len == size)
+    {
+      size = size ? size*2 : 65536;
+      nbuf = realloc(mp->buf, size);
+      if (!nbuf)
+	goto Fail;
+      mp->buf = nbuf;
+    }
+
+    rc = read(fd, mp->buf+mp->len, size-mp->len);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      goto Fail;
+    if (rc == 0)
+      break;
+    mp->len += rc;
+  }
+
+  close(fd);
+  return mp;
+
+ Fail:
+  close(fd);
+  free(mp->buf);
+  free(mp);
+  return NULL;
+}
+
+/*
+** Open a file for csv_field() that is read a line at a time into a
+** buffer instead, so that only the longest line has to fit in memory.
+** csv_fill() must be called before the fields of each line are read.
+*/
+CSVMAP *
+csv_stream(const char *path)
+{
+  CSVMAP *mp;
+
+
+  mp = malloc(sizeof(*mp));
+  if (!mp)
+    return NULL;
+  memset(mp, 0, sizeof(*mp));
+
+  mp->size = 65536;
+  mp->buf = malloc(mp->size);
+  mp->fd = open(path, O_RDONLY);
+  if (!mp->buf || mp->fd < 0)
+  {
+    if (mp->fd >= 0)
+      close(mp->fd);
+    free(mp->buf);
+    free(mp);
+    return NULL;
+  }
+
+  fstat(mp->fd, &mp->st);
+  return mp;
+}
+
+/*
+** Have the line at the current position of a streamed file, and the
+** byte after its end, in the buffer. A newline always ends a line,
+** quoted or not. Returns 0, or -1 on read errors.
+*/
+int
+csv_fill(CSVMAP *mp)
+{
+  char *nbuf;
+  size_t i;
+  ssize_t rc;
+
+
+  if (mp->fd < 0)
+    return 0;
+
+  for (i = mp->pos; ; )
+  {
+    while (i < mp->len && mp->buf[i] != '\n' && mp->buf[i] != '\r')
+      ++i;
+    if ((i+1 < mp->len) || mp->eof)
+      return 0;
+
+    /* Keep the partial line, and read more after it */
+    i -= mp->pos;
+    memmove(mp->buf, mp->buf + mp->pos, mp->len - mp->pos);
+    mp->len -= mp->pos;
+    mp->pos = 0;
+
+    if (mp->len == mp->size)
+    {
+      nbuf = realloc(mp->buf, mp->size * 2);
+      if (!nbuf)
+	return -1;
+      mp->buf = nbuf;
+      mp->size *= 2;
+    }
+
+    rc = read(mp->fd, mp->buf + mp->len, mp->size - mp->len);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      return -1;
+    if (rc == 0)
+      mp->eof = 1;
+    mp->len += rc;
+  }
+}
+
+void
+csv_unmap(CSVMAP *mp)
+{
+  if (mp->fd >= 0)
+    close(mp->fd);
+  if (mp->mapped)
+    munmap(mp->buf, mp->len);
+  else
+    free(mp->buf);
+  free(mp);
+}
+
+
+static unsigned char csv_special[256];
+
+/* First separator, quote or newline at or after p */
+static char *
+csv_scan(char *p,
+	 char *end)
+{
+#ifdef __SSE2__
+  const __m128i sc = _mm_set1_epi8(';');
+  const __m128i dq = _mm_set1_epi8('"');
+  const __m128i sq = _mm_set1_epi8('\'');
+  const __m128i nl = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  __m128i v, m;
+  int bits;
+
+
+  while (end - p >= 16)
+  {
+    v = _mm_loadu_si128((const __m128i *) p);
+    m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sc),
+				  _mm_cmpeq_epi8(v, dq)),
+		     _mm_or_si128(_mm_cmpeq_epi8(v, sq),
+				  _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+					       _mm_cmpeq_epi8(v, cr))));
+    bits = _mm_movemask_epi8(m);
+    if (bits)
+      return p + __builtin_ctz(bits);
+    p += 16;
+  }
+#endif
+
+  if (!csv_special[';'])
+  {
+    csv_special[';'] = 1;
+    csv_special['"'] = 1;
+    csv_special['\''] = 1;
+    csv_special['\n'] = 1;
+    csv_special['\r'] = 1;
+  }
+
+  while (p < end && !csv_special[(unsigned char) *p])
+    ++p;
+  return p;
+}
+
+/*
+** Get the next field of a mapped file, with the same results as
+** csv_gets(): the field length, -2 at end of line or -1 at end of
+** file. *sp is set to the field, which is not NUL terminated and
+** stays valid until csv_unmap(). Unquoted fields are returned as is.
+*/
+int
+csv_field(CSVMAP *mp,
+	  char **sp)
+{
+  char *p, *out, *end;
+  int q = 0;
+  int c, len;
+
+
+  p = *sp = mp->buf + mp->pos;
+  end = mp->buf + mp->len;
+
+  p = csv_scan(p, end);
+  if (p < end && (*p == '"' || *p == '\''))
+  {
+    for (out = p; p < end; ++p)
+    {
+      c = *p;
+      if (c == '\n' || c == '\r')
+	break;
+
+      if (q)
+      {
+	if (c == q)
+	{
+	  q = 0;
+	  continue;
+	}
+      }
+      else if (c == ';')
+	break;
+      else if (c == '"' || c == '\'')
+      {
+	q = c;
+	continue;
+      }
+
+      *out++ = c;
+    }
+    len = out - *sp;
+  }
+  else
+    len = p - *sp;
+
+  if (len > 0)
+  {
+    if (p < end && *p == ';')
+      ++p;
+    mp->pos = p - mp->buf;
+    return len;
+  }
+
+  if (p >= end)
+  {
+    mp->pos = mp->len;
+    return -1;
+  }
+
+  switch (*p++)
+  {
+    case '\r':
+      if (p < end && *p == '\n')
+	++p;
+      len = -2;
+      break;
+
+    case '\n':
+      if (p < end && *p == '\r')
+	++p;
+      len = -2;
+      break;
+  }
+
+  mp->pos = p - mp->buf;
+  return len;
+}
+
+
+/*
+** Where to split buf (of len bytes) into parts to be read on their
+** own, near pos: the end of the first line end after pos, where lo
+** (at most pos) is known to be the start of a line. A newline ends
+** a line even within quotes, and a CR LF or LF CR pair is one line
+** end, as csv_field() reads them.
+*/
+size_t
+csv_split(const char *buf,
+	  size_t len,
+	  size_t lo,
+	  size_t pos)
+{
+  size_t p = pos;
+  int c;
+
+
+  while (p < len && buf[p] != '\n' && buf[p] != '\r')
+    ++p;
+  if (p >= len)
+    return len;
+
+  /* Pairs are taken from the start of a run of line ends */
+  while (p > lo && (buf[p-1] == '\n' || buf[p-1] == '\r'))
+    --p;
+
+  while (p < len && (buf[p] == '\n' || buf[p] == '\r'))
+  {
+    c = buf[p++];
+    if (p < len && buf[p] == (c == '\n' ? '\r' : '\n'))
+      ++p;
+    if (p > pos)
+      break;
+  }
+
+  return p;
+}
+
+/* The number of line ends in len bytes at buf that start with a line */
+int
+csv_lines(const char *buf,
+	  size_t len)
+{
+  size_t p;
+  int n = 0;
+
+
+  for (p = 0; p < len; ++p)
+    if (buf[p] == '\n' || buf[p] == '\r')
+    {
+      ++n;
+      if (p+1 < len && buf[p+1] == (buf[p] == '\n' ? '\r' : '\n'))
+	++p;
+    }
+
+  return n;
+}
 #ifdef DEBUG
 int
 main(int argc,
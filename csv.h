@@ -11,6 +11,18 @@ typedef struct
     int st;
 } CSV;
 
+typedef struct
+{
+    char *buf;
+    size_t len;
+    size_t pos;
+    int mapped;
+    struct stat st;
+    int fd;			/* Streamed files, see csv_stream() */
+    size_t size;
+    int eof;
+} CSVMAP;
+
 
 extern CSV *
 csv_open(const char *path,
@@ -50,4 +62,30 @@ extern int
 csv_geti(int *ip,
 	 CSV *cp);
 
+extern CSVMAP *
+csv_map(const char *path);
+
+extern void
+csv_unmap(CSVMAP *mp);
+
+extern CSVMAP *
+csv_stream(const char *path);
+
+extern int
+csv_fill(CSVMAP *mp);
+
+extern size_t
+csv_split(const char *buf,
+	  size_t len,
+	  size_t lo,
+	  size_t pos);
+
+extern int
+csv_lines(const char *buf,
+	  size_t len);
+
+extern int
+csv_field(CSVMAP *mp,
+	  char **sp);
+
 #endif
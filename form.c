@@ -157,6 +157,43 @@ form_get(const char *var)
 }
 
 
+/*
+** Get a variable of the query string without form_init(), which takes
+** the string apart. Returns it malloc()ed, or NULL.
+*/
+char *
+form_peek(const char *var)
+{
+    char *ep = getenv("QUERY_STRING");
+    char *rm = getenv("REQUEST_METHOD");
+    char *buf, *cp, *vp, *tokp, *val = NULL;
+
+
+    if (!ep || !*ep || (rm && strcmp(rm, "POST") == 0))
+	return NULL;
+
+    buf = strdup(ep);
+    if (!buf)
+	return NULL;
+
+    for (cp = strtok_r(buf, "&", &tokp); cp; cp = strtok_r(NULL, "&", &tokp))
+    {
+	vp = strchr(cp, '=');
+	if (vp)
+	    *vp++ = '\0';
+
+	if (strcmp(http_strip(cp), var) == 0)
+	{
+	    val = (vp && vp[0]) ? strdup(http_strip(vp)) : NULL;
+	    break;
+	}
+    }
+
+    free(buf);
+    return val;
+}
+
+
 int
 form_foreach(int (*fun)(const char *var, const char *val, void *x), void *x)
 {
@@ -15,6 +15,9 @@ form_init(FILE *fp);
 extern char *
 form_get(const char *var);
 
+extern char *
+form_peek(const char *var);
+
 extern void
 form_cgi_post(FILE *fp);
 
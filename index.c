@@ -6,6 +6,13 @@
 
 #define MAXNODES 2000
 
+#define CACHE_MISSING 0
+#define CACHE_FRESH   1
+#define CACHE_STALE   2
+
+#define WATCH_HEARTBEAT 60
+#define REBUILD_TIME 120
+
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -19,22 +26,39 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 #include <dirent.h>
+#include <glob.h>
+
+#ifdef __linux__
+#include <sys/select.h>
+#include <sys/inotify.h>
+#endif
 
 #include "strmatch.h"
 #include "html.h"
 #include "table.h"
 #include "form.h"
 #include "creole.h"
+#include "arena.h"
+#include "twhere.h"
+#include "tfrag.h"
+#include "collate.h"
 
 int debug = 0;
 int nowrap = 0;
 int raw = 0;
+int lazy_tree = 0;
 time_t now = 0;
 
 char **our_argv = NULL;
 
 int max_cache_time = 300;
+int max_stale_time = 3600;
+int shard_nodes = 256;
+
+/* Directive temporaries, released all at once when the request is done */
+ARENA *req_arena = NULL;
 
 time_t file_dtm = 0;
 
@@ -42,10 +66,15 @@ typedef struct dirnode
 {
   char *path;
   char *title;
+  char *key;     /* Collation key of the title, made when sorted */
   int hidden;
   int len;
   int size;
+  int nsub;      /* Number of subdirectories, known before node[] is loaded */
+  int loaded;    /* node[] and len are valid */
+  int shard;     /* Subtree is stored in its own .cache file */
   struct dirnode **node;
+  ARENA *arena;  /* Shared by all nodes of a tree */
 } DIRNODE;
 
 char *global_cache_path = NULL;
@@ -74,6 +103,13 @@ char *http_user_agent = NULL;
 int skip_header = 0;
 int skip_footer = 0;
 
+/* ?x-fragment=table:N[:json] renders only the Nth x-table of the page */
+int fragment_table = 0;
+int fragment_json = 0;
+int fragment_done = 0;
+int xtable_seen = 0;
+int xtable_page = 0;		/* Parsing the page, not header.html or footer.html */
+
 char *ssi_errmsg = "[An error occurred while processing this directive]";
 char *ssi_timefmt = "%Y-%m-%d %H:%M:%S";
 char *ssi_sizefmt = "bytes";
@@ -449,6 +485,69 @@ fconcat(const char *p1,
 }
 
 
+/*
+** Request-scoped versions of strdup(), concat() and fconcat().
+** Results must not be freed, nor kept past the current request.
+*/
+char *
+req_strdup(const char *s)
+{
+  char *res = arena_strdup(req_arena, s);
+  if (!res)
+    fail("arena_strdup", NULL);
+
+  return res;
+}
+
+char *
+req_concat(const char *s1,
+	   const char *s2,
+	   const char *s3)
+{
+  int l1, l2, l3;
+  char *res;
+
+
+  l1 = strlen(s1);
+  l2 = s2 ? strlen(s2) : 0;
+  l3 = s3 ? strlen(s3) : 0;
+  
+  res = arena_alloc(req_arena, l1+l2+l3+1);
+  if (!res)
+    fail("arena_alloc", NULL);
+
+  memcpy(res, s1, l1);
+  memcpy(res+l1, s2, l2);
+  memcpy(res+l1+l2, s3, l3);
+  res[l1+l2+l3] = '\0';
+
+  return res;
+}
+
+char *
+req_fconcat(const char *p1,
+	    const char *p2)
+{
+  int len;
+  char *new;
+
+  
+  len = strlen(p1);
+  while (len > 0 && p1[len-1] == '/')
+    --len;
+
+  new = arena_alloc(req_arena, len+2+strlen(p2));
+  if (!new)
+    fail("arena_alloc", NULL);
+  
+  memcpy(new, p1, len);
+  new[len++] = '/';
+  strcpy(new+len, p2);
+
+  return new;
+}
+
+
 time_t
 str2time(const char *str)
 {
@@ -648,60 +747,295 @@ file_get_section(const char *path,
   return head;
 }
 
+int
+nocache(void)
+{
+  if (!http_cache_control)
+    return 0;
+
+  return (strcmp(http_cache_control, "no-cache") == 0);
+}
+
+
+/*
+** True if an "index --watch" process keeps the caches under the
+** document root up to date (see dirtree_watch()).
+*/
+int
+dirtree_watched(void)
+{
+  static int watched = -1;
+  struct stat sb;
+  char *path;
+
+  
+  if (watched < 0)
+  {
+    watched = 0;
+    if (document_root)
+    {
+      path = fconcat(document_root, ".cache.watch");
+      watched = (stat(path, &sb) == 0 && sb.st_mtime + 2*WATCH_HEARTBEAT >= now);
+      free(path);
+    }
+  }
+
+  return watched;
+}
+
+
+/*
+** A cache file is fresh if it is younger than max_cache_time and
+** not older than the directory it describes. Otherwise it may still
+** be served (while being rebuilt in the background) until it is
+** older than max_stale_time.
+*/
+int
+dirtree_cache_state(const char *cpath,
+		    const char *dpath,
+		    struct stat *sp)
+{
+  struct stat db;
+
+  
+  if (nocache() || stat(cpath, sp) != 0)
+    return CACHE_MISSING;
+
+  if (dirtree_watched())
+    return CACHE_FRESH;
+
+  if (sp->st_mtime + max_stale_time < now)
+    return CACHE_MISSING;
+  
+  if (sp->st_mtime + max_cache_time < now)
+    return CACHE_STALE;
+
+  if (stat(dpath, &db) == 0 && db.st_mtime > sp->st_mtime)
+    return CACHE_STALE;
+
+  return CACHE_FRESH;
+}
+
+/*
+** Skip the comments at the start of a cache file. Returns 0, or -1
+** if its nodes were sorted by another collation than the current
+** one (files without a "Collation" line were sorted in byte order).
+*/
+int
+dirtree_cache_collation(FILE *fp)
+{
+  char buf[2048];
+  const char *name = collate_name();
+  size_t len = strlen(name);
+  int c, same;
+
+  
+  same = (strcmp(name, "C") == 0);
+  while ((c = getc(fp)) == '#')
+  {
+    if (!fgets(buf, sizeof(buf), fp))
+      return same ? 0 : -1;
+    
+    if (strncmp(buf, " Collation: ", 12) == 0)
+      same = (strncmp(buf+12, name, len) == 0 && buf[12+len] == '\n');
+    
+    while (!strchr(buf, '\n') && fgets(buf, sizeof(buf), fp))
+      ;
+  }
+  
+  if (c != EOF)
+    ungetc(c, fp);
+  return same ? 0 : -1;
+}
+
+
+/*
+** All nodes of a tree, their strings and child arrays are allocated
+** from one arena, so a whole tree is released at once by freeing its
+** root. Subtrees that are dropped from a tree stay allocated until
+** then.
+*/
 void
 dirtree_free(DIRNODE *dnp)
 {
-  int i;
-
-  if (dnp == global_cache_dnp)
+  if (!dnp || dnp == global_cache_dnp)
     return;
+
+  arena_destroy(dnp->arena);
+}
+
+
+DIRNODE *
+dirnode_alloc(ARENA *ap,
+	      const char *path,
+	      const char *title)
+{
+  DIRNODE *dnp;
+
   
-  for (i = 0; i < dnp->len; i++)
-    dirtree_free(dnp->node[i]);
+  dnp = arena_alloc(ap, sizeof(*dnp));
+  if (!dnp)
+    abort();
+  
+  memset(dnp, 0, sizeof(*dnp));
+  dnp->arena = ap;
+  dnp->path = arena_strdup(ap, path);
+  dnp->title = arena_strdup(ap, title);
+  if (!dnp->path || !dnp->title)
+    abort();
+  
+  return dnp;
+}
+
+
+void
+dirnode_add(DIRNODE *dnp,
+	    DIRNODE *node)
+{
+  DIRNODE **nv;
+
+  
+  if (dnp->len + 1 >= dnp->size)
+  {
+    dnp->size = dnp->size ? dnp->size*2 : 8;
+    nv = arena_alloc(dnp->arena, dnp->size * sizeof(DIRNODE *));
+    if (!nv)
+      abort();
+    
+    if (dnp->len)
+      memcpy(nv, dnp->node, dnp->len * sizeof(DIRNODE *));
+    dnp->node = nv;
+  }
+  
+  dnp->node[dnp->len++] = node;
+}
+
+
+int
+dirtree_count(DIRNODE *dnp)
+{
+  int i, n;
 
-  if (dnp->path)
-    free(dnp->path);
+  
+  if (!dnp)
+    return 0;
 
-  if (dnp->title)
-    free(dnp->title);
+  n = 1;
+  if (!dnp->shard)
+    for (i = 0; i < dnp->len; i++)
+      n += dirtree_count(dnp->node[i]);
 
-  free(dnp);
+  return n;
 }
 
 
+int
+dirtree_save(DIRNODE *dnp,
+	     const char *cpath);
+
+/*
+** Subtrees of at least shard_nodes nodes are written to a .cache file
+** of their own, and only referenced (path, title, hidden flag, child
+** count and a shard marker) from the parent's file.
+*/
 void
 dirnode_save(DIRNODE *dnp,
-	     FILE *out)
+	     FILE *out,
+	     int *count)
 {
   int i;
-  static int count = 0;
+  char *cpath;
+  DIRNODE *node;
   
   if (!dnp)
   {
     fprintf(out, "# Got NULL node\n");
     return;
   }
-  if (count >= MAXNODES)
+  if (*count >= MAXNODES)
   {
-    fprintf(out, "# Got too many nodes: %d\n", count);
+    fprintf(out, "# Got too many nodes: %d\n", *count);
     return;
   }
 
-  fprintf(out, "# Node %u\n", count++);
+  fprintf(out, "# Node %u\n", (*count)++);
   fprintf(out, "%s\n", dnp->path);
   fprintf(out, "%s\n", dnp->title);
+
+  if (dnp->shard)
+  {
+    fprintf(out, "%u %u 1\n", dnp->hidden, dnp->loaded ? dnp->len : dnp->nsub);
+    return;
+  }
+  
   fprintf(out, "%u %u\n", dnp->hidden, dnp->len);
   
   for (i = 0; i < dnp->len; i++)
-    dirnode_save(dnp->node[i], out);
+  {
+    node = dnp->node[i];
+    if (node && !node->shard && dirtree_count(node) >= shard_nodes)
+    {
+      cpath = fconcat(node->path, ".cache");
+      dirtree_save(node, cpath);
+      free(cpath);
+    }
+    
+    dirnode_save(node, out, count);
+  }
+}
+
+/*
+** Write the (sharded) cache file for a tree. The file is written to
+** a temporary name and then renamed into place.
+*/
+int
+dirtree_save(DIRNODE *dnp,
+	     const char *cpath)
+{
+  char *tpath;
+  char sbuf[64];
+  FILE *fp;
+  int count = 0;
+  int rc = -1;
+
+  
+  if (!dnp)
+    return -1;
+  
+  sprintf(sbuf, ".tmp.%u", (unsigned int) getpid());
+  tpath = concat(cpath, sbuf, NULL);
+
+  fp = fopen(tpath, "w");
+  if (fp)
+  {
+    if (debug)
+      fprintf(stderr, "dirtree_save: creating new cache file: %s\n", cpath);
+    
+    fprintf(fp, "# Cache path: %s\n", cpath);
+    fprintf(fp, "# Collation: %s\n", collate_name());
+    dnp->shard = 0;
+    dirnode_save(dnp, fp, &count);
+    
+    if (fclose(fp) == 0 && rename(tpath, cpath) == 0)
+      rc = 0;
+    else
+      unlink(tpath);
+  }
+  
+  dnp->shard = (rc == 0);
+  free(tpath);
+  return rc;
 }
 
 
 DIRNODE *
-dirnode_load(FILE *in)
+dirnode_load(FILE *in,
+	     ARENA *ap)
 {
   int i, c;
-  char buf[2048];
+  int shard = 0;
+  int hidden, len;
+  char buf[2048], tbuf[2048];
 
   
   DIRNODE *dnp;
@@ -721,49 +1055,38 @@ dirnode_load(FILE *in)
   else
     ungetc(c, in);
   
-  dnp = malloc(sizeof(DIRNODE));
-  if (!dnp)
-    abort();
-  
-  memset(dnp, 0, sizeof(dnp));
-
   buf[0] = '\0';
-  if (fscanf(in, "%[^\n]\n", buf) < 1)
-  {
-    free(dnp);
+  if (fscanf(in, "%[^\n]\n", buf) < 1 ||
+      fscanf(in, "%[^\n]\n", tbuf) < 1)
     return NULL;
-  }
   
-  dnp->path = strdup(buf);
-  if (!dnp->path)
-    abort();
+  dnp = dirnode_alloc(ap, buf, tbuf);
   
-  if (fscanf(in, "%[^\n]\n", buf) < 1)
-  {
-    free(dnp->path);
-    free(dnp);
+  if (fscanf(in, "%[^\n]\n", buf) < 1 ||
+      sscanf(buf, "%u %u %u", &hidden, &len, &shard) < 2)
     return NULL;
-  }
-  
-  dnp->title = strdup(buf);
-  if (!dnp->title)
-    abort();
+
+  dnp->hidden = hidden;
   
-  if (fscanf(in, "%u %u\n", &dnp->hidden, &dnp->len) < 2)
+  if (shard)
   {
-    free(dnp->path);
-    free(dnp->title);
-    free(dnp);
-    return NULL;
+    /* Reference to a subtree shard, loaded when expanded */
+    dnp->nsub = len;
+    dnp->shard = 1;
+    return dnp;
   }
-  
-  dnp->node = calloc(sizeof(dnp->node[0]), dnp->len);
+
+  /* Children are laid out right after their parent */
+  dnp->node = arena_alloc(ap, (len ? len : 1) * sizeof(dnp->node[0]));
   if (!dnp->node)
     abort();
   
-  for (i = 0; i < dnp->len; i++)
-    dnp->node[i] = dirnode_load(in);
+  for (i = 0; i < len; i++)
+    dnp->node[i] = dirnode_load(in, ap);
 
+  dnp->len = dnp->size = len;
+  dnp->nsub = len;
+  dnp->loaded = 1;
   return dnp;
 }
 
@@ -776,25 +1099,87 @@ dirnode_compare_title(const void *n1,
   d1 = * (DIRNODE **) n1;
   d2 = * (DIRNODE **) n2;
 
-  return strcmp(d1->title, d2->title);
+  return strcmp(d1->key, d2->key);
 }
 
+/*
+** Sort the children of a node by title. The titles are compared on
+** their collation keys (see collate.c), made once for each node.
+*/
 void
-dirtree_sort_title(DIRNODE *dnp)
+dirnode_sort(DIRNODE *dnp)
 {
+  DIRNODE *node;
+  size_t len;
   int i;
 
+  
   for (i = 0; i < dnp->len; i++)
-    dirtree_sort_title(dnp->node[i]);
+  {
+    node = dnp->node[i];
+    if (!node || node->key)
+      continue;
+
+    if (!collate_id())
+    {
+      node->key = node->title;
+      continue;
+    }
+    
+    len = collate_xfrm(NULL, node->title, 0);
+    node->key = arena_alloc(node->arena, len + 1);
+    if (!node->key)
+      abort();
+    collate_xfrm(node->key, node->title, len + 1);
+  }
   
   qsort((void *) &dnp->node[0], dnp->len, sizeof(dnp->node[0]), dirnode_compare_title);
+}
+
+/*
+** Count the subdirectories of an open directory. Used to give
+** unexpanded (lazy) nodes a child count without descending into them.
+*/
+int
+dirnode_count(DIR *dp,
+	      const char *path)
+{
+  struct dirent *dep;
+  struct stat sb;
+  char *tpath;
+  int n = 0;
+
+  
+  while ((dep = readdir(dp)) != NULL)
+  {
+    if (strcmp(dep->d_name, ".") == 0 ||
+	strcmp(dep->d_name, "..") == 0)
+      continue;
+
+#ifdef DT_DIR
+    if (dep->d_type == DT_DIR)
+    {
+      ++n;
+      continue;
+    }
+    if (dep->d_type != DT_UNKNOWN)
+      continue;
+#endif
+    
+    tpath = fconcat(path, dep->d_name);
+    if (lstat(tpath, &sb) == 0 && S_ISDIR(sb.st_mode))
+      ++n;
+    free(tpath);
+  }
 
+  return n;
 }
 
 
 DIRNODE *
 dirnode_parse(const char *path,
-	      int descend)
+	      int descend,
+	      ARENA *ap)
 {
   char *npath, *tpath, *ipath, *cp;
   char *title = NULL;
@@ -828,15 +1213,10 @@ dirnode_parse(const char *path,
   if (!title)
     goto Fail;
   
-  dnp = malloc(sizeof(*dnp));
-  if (!dnp)
-    goto Fail;
-  
-  dnp->path = npath;
-  dnp->title = title;
-  dnp->len = 0;
-  dnp->size = 32;
-  dnp->node = malloc(dnp->size * sizeof(DIRNODE *));
+  dnp = dirnode_alloc(ap, npath, title);
+  dnp->loaded = (descend != 0);
+  free(title);
+  free(npath);
   
   ipath = fconcat(dnp->path, ".hidden");
   dnp->hidden = (access(ipath, R_OK) == 0);
@@ -852,49 +1232,356 @@ dirnode_parse(const char *path,
       tpath = fconcat(dnp->path, dep->d_name);
       if (lstat(tpath, &sb) == 0 && S_ISDIR(sb.st_mode))   /* lstat? Don't follow symlinks...? */
       {
-	DIRNODE *node = dirnode_parse(tpath, descend-1);
-	
-	if (node)
+	DIRNODE *node;
+
+	/* Existing shards are only refreshed when expanded */
+	ipath = fconcat(tpath, ".cache");
+	if (!nocache() && access(ipath, R_OK) == 0)
 	{
-	  if (dnp->len + 1 >= dnp->size)
-	  {
-	    dnp->size += 32;
-	    dnp->node = realloc(dnp->node, dnp->size * sizeof(DIRNODE *));
-	  }
-	  dnp->node[dnp->len++] = node;
+	  node = dirnode_parse(tpath, 0, ap);
+	  if (node)
+	    node->shard = 1;
 	}
+	else
+	  node = dirnode_parse(tpath, descend-1, ap);
+	free(ipath);
+	
+	if (node)
+	  dirnode_add(dnp, node);
       }
       
       if (tpath)
 	free(tpath);
     }
-  
-  dirtree_sort_title(dnp);
+  else
+    dnp->nsub = dirnode_count(dp, dnp->path);
+
+  if (descend)
+    dnp->nsub = dnp->len;
+
+  /* The subtrees below are already sorted */
+  dirnode_sort(dnp);
   
   closedir(dp);
   return dnp;
 
   Fail:
-  if (title)
-    free(title);
-
-  if (npath)
-    free(npath);
-  
-  if (dnp)
-    dirtree_free(dnp);
-  
+  free(npath);
   closedir(dp);
   return NULL;
 }
 
+
+/*
+** Per-directory cache records used by the lazy tree mode. A record
+** holds the summary (path, title, hidden flag, child count) of the
+** immediate children of one directory, sorted by title.
+*/
 int
-nocache(void)
+dirnode_load_record(DIRNODE *dnp)
 {
-  if (!http_cache_control)
-    return 0;
+  char *rpath;
+  char buf[2048], tbuf[2048];
+  DIRNODE *node;
+  FILE *fp;
+  struct stat sb, db;
+  unsigned int hidden, nsub;
+  int c;
 
-  return (strcmp(http_cache_control, "no-cache") == 0);
+  
+  if (nocache())
+    return -1;
+  
+  rpath = fconcat(dnp->path, ".dircache");
+  if (stat(rpath, &sb) != 0 ||
+      stat(dnp->path, &db) != 0 ||
+      sb.st_mtime < db.st_mtime ||
+      sb.st_mtime + max_cache_time < now ||
+      (fp = fopen(rpath, "r")) == NULL)
+  {
+    free(rpath);
+    return -1;
+  }
+  free(rpath);
+
+  if (debug)
+    fprintf(stderr, "dirnode_load_record: path=%s\n", dnp->path);
+
+  if (dirtree_cache_collation(fp) < 0)
+  {
+    fclose(fp);
+    return -1;
+  }
+  
+  while ((c = getc(fp)) != EOF)
+  {
+    if (c == '#')
+    {
+      while ((c = getc(fp)) != EOF && c != '\n')
+	;
+      continue;
+    }
+    ungetc(c, fp);
+    
+    if (fscanf(fp, "%[^\n]\n", buf) < 1 ||
+	fscanf(fp, "%[^\n]\n", tbuf) < 1 ||
+	fscanf(fp, "%u %u\n", &hidden, &nsub) < 2)
+    {
+      /* Partial children are dropped by the caller */
+      fclose(fp);
+      return -1;
+    }
+    
+    node = dirnode_alloc(dnp->arena, buf, tbuf);
+    node->hidden = hidden;
+    node->nsub = nsub;
+    dirnode_add(dnp, node);
+  }
+  
+  fclose(fp);
+  return dnp->len;
+}
+
+void
+dirnode_save_record(DIRNODE *dnp)
+{
+  char *rpath, *tpath;
+  char sbuf[64];
+  FILE *fp;
+  int i;
+  
+
+  rpath = fconcat(dnp->path, ".dircache");
+  sprintf(sbuf, ".tmp.%u", (unsigned int) getpid());
+  tpath = concat(rpath, sbuf, NULL);
+
+  fp = fopen(tpath, "w");
+  if (fp)
+  {
+    fprintf(fp, "# Dir record: %s\n", dnp->path);
+    fprintf(fp, "# Collation: %s\n", collate_name());
+    for (i = 0; i < dnp->len; i++)
+      fprintf(fp, "%s\n%s\n%u %u\n",
+	      dnp->node[i]->path,
+	      dnp->node[i]->title,
+	      dnp->node[i]->hidden,
+	      dnp->node[i]->nsub);
+    
+    if (fclose(fp) != 0 || rename(tpath, rpath) != 0)
+      unlink(tpath);
+  }
+
+  free(tpath);
+  free(rpath);
+}
+
+
+static const char *rebuild_lock = NULL;
+
+static void
+rebuild_timeout(int sig)
+{
+  unlink(rebuild_lock);
+  _exit(1);
+}
+
+/*
+** Rebuild a stale cache file in a detached background process. A
+** lock file makes sure only one rebuild per cache file is running.
+** A rebuild gets REBUILD_TIME seconds, after which its lock is gone
+** or, if it could not remove it, counts as left behind.
+*/
+void
+dirtree_revalidate(const char *path,
+		   const char *cpath)
+{
+  char *lpath;
+  DIRNODE *dnp;
+  struct stat sb;
+  pid_t pid;
+  int fd;
+
+  
+  lpath = concat(cpath, ".lock", NULL);
+  
+  fd = open(lpath, O_CREAT|O_EXCL|O_WRONLY, 0644);
+  if (fd < 0 && errno == EEXIST &&
+      stat(lpath, &sb) == 0 && sb.st_mtime + REBUILD_TIME < now)
+  {
+    /* Left behind by a rebuild that died */
+    unlink(lpath);
+    fd = open(lpath, O_CREAT|O_EXCL|O_WRONLY, 0644);
+  }
+  
+  if (fd < 0)
+  {
+    free(lpath);
+    return;
+  }
+  close(fd);
+
+  if (debug)
+    fprintf(stderr, "dirtree_revalidate: rebuilding in background: %s\n", cpath);
+  
+  fflush(stdout);
+  fflush(stderr);
+  
+  pid = fork();
+  if (pid < 0)
+  {
+    unlink(lpath);
+    free(lpath);
+    return;
+  }
+
+  if (pid == 0)
+  {
+    setsid();
+    pid = fork();
+    if (pid < 0)
+      unlink(lpath);
+    if (pid != 0)
+      _exit(0);
+
+    /* Let the web server see EOF on our output */
+    fd = open("/dev/null", O_RDWR);
+    if (fd >= 0)
+    {
+      dup2(fd, 0);
+      dup2(fd, 1);
+      if (!debug)
+	dup2(fd, 2);
+      if (fd > 2)
+	close(fd);
+    }
+    rebuild_lock = lpath;
+    signal(SIGALRM, rebuild_timeout);
+    alarm(REBUILD_TIME);
+
+    dnp = dirnode_parse(path, -1, arena_create(0));
+    dirtree_save(dnp, cpath);
+    unlink(lpath);
+    _exit(0);
+  }
+
+  waitpid(pid, NULL, 0);
+  free(lpath);
+}
+
+
+/*
+** Load the children of a shard reference from the subtree's own
+** cache file, rebuilding just that shard if it is not fresh.
+*/
+int
+dirnode_load_shard(DIRNODE *dnp)
+{
+  char *cpath;
+  DIRNODE *sdnp = NULL;
+  FILE *fp;
+  struct stat sb;
+  int state;
+
+
+  cpath = fconcat(dnp->path, ".cache");
+  
+  if ((state = dirtree_cache_state(cpath, dnp->path, &sb)) != CACHE_MISSING &&
+      (fp = fopen(cpath, "r")) != NULL)
+  {
+    if (debug)
+      fprintf(stderr, "dirnode_load_shard: Using shard: %s\n", cpath);
+    
+    if (dirtree_cache_collation(fp) == 0)
+      sdnp = dirnode_load(fp, dnp->arena);
+    fclose(fp);
+
+    if (sdnp && state == CACHE_STALE)
+      dirtree_revalidate(dnp->path, cpath);
+  }
+
+  if (!sdnp)
+  {
+    sdnp = dirnode_parse(dnp->path, -1, dnp->arena);
+    if (sdnp)
+      dirtree_save(sdnp, cpath);
+  }
+  
+  free(cpath);
+  if (!sdnp)
+    return 0;
+
+  /* The shard root itself stays behind in the arena */
+  dnp->node = sdnp->node;
+  dnp->len = sdnp->len;
+  dnp->size = sdnp->size;
+  
+  return dnp->len;
+}
+
+
+/*
+** Make sure the children of a node are loaded, materializing them
+** from the directory record or from disk for unexpanded lazy nodes.
+** Returns the number of children.
+*/
+int
+dirnode_expand(DIRNODE *dnp)
+{
+  DIR *dp;
+  DIRNODE *node;
+  struct dirent *dep;
+  struct stat sb;
+  char *tpath;
+  
+
+  if (!dnp)
+    return 0;
+  
+  if (dnp->loaded)
+    return dnp->len;
+
+  dnp->loaded = 1;
+  if (dnp->shard)
+    return dirnode_load_shard(dnp);
+
+  if (dnp->nsub == 0)
+    return 0;
+  
+  if (dirnode_load_record(dnp) >= 0)
+    return dnp->len;
+
+  dnp->len = 0;
+  
+  if (debug > 1)
+    fprintf(stderr, "dirnode_expand: path=%s\n", dnp->path);
+  
+  dp = opendir(dnp->path);
+  if (!dp)
+    return 0;
+
+  while ((dep = readdir(dp)) != NULL)
+  {
+    if (strcmp(dep->d_name, ".") == 0 ||
+	strcmp(dep->d_name, "..") == 0)
+      continue;
+    
+    tpath = fconcat(dnp->path, dep->d_name);
+    if (lstat(tpath, &sb) == 0 && S_ISDIR(sb.st_mode))
+    {
+      node = dirnode_parse(tpath, 0, dnp->arena);
+      if (node)
+	dirnode_add(dnp, node);
+    }
+    free(tpath);
+  }
+  closedir(dp);
+
+  dirnode_sort(dnp);
+  
+  if (!nocache())
+    dirnode_save_record(dnp);
+  
+  return dnp->len;
 }
 
 
@@ -904,6 +1591,8 @@ dirtree_load(const char *path,
 {
   char *cpath;
   DIRNODE *dnp = NULL, *tdnp;
+  ARENA *ap;
+  int state;
   FILE *fp;
   struct stat sb;
   
@@ -913,10 +1602,35 @@ dirtree_load(const char *path,
   if (debug)
     fprintf(stderr, "dirtree_load: path=%s\n", path);
 
+  if (lazy_tree)
+  {
+    free(cpath);
+    
+    if (global_cache_dnp && strcmp(path, global_cache_path) == 0)
+      return global_cache_dnp;
+
+    ap = arena_create(0);
+    dnp = dirnode_parse(path, 0, ap);
+    if (!dnp)
+      arena_destroy(ap);
+    else
+    {
+      if (global_cache_dnp)
+      {
+	tdnp = global_cache_dnp;
+	global_cache_dnp = NULL;
+	dirtree_free(tdnp);
+	free(global_cache_path);
+      }
+      
+      global_cache_dnp = dnp;
+      global_cache_path = strdup(path);
+    }
+    
+    return dnp;
+  }
 
-  if (!nocache() &&
-      stat(cpath, &sb) == 0 &&
-      (sb.st_mtime + max_cache_time >= now) &&
+  if ((state = dirtree_cache_state(cpath, path, &sb)) != CACHE_MISSING &&
       (fp = fopen(cpath, "r")) != NULL)
   {
     if (debug)
@@ -924,11 +1638,18 @@ dirtree_load(const char *path,
 	      sb.st_mtime, max_cache_time, sb.st_mtime+max_cache_time,
 	      now, cpath);
   
-    dnp = dirnode_load(fp);
+    ap = arena_create(0);
+    if (dirtree_cache_collation(fp) == 0)
+      dnp = dirnode_load(fp, ap);
     fclose(fp);
     
-    if (dnp != NULL)
+    if (!dnp)
+      arena_destroy(ap);
+    else
     {
+      if (state == CACHE_STALE)
+	dirtree_revalidate(path, cpath);
+      
       if (global_cache_dnp)
       {
 	tdnp = global_cache_dnp;
@@ -947,19 +1668,17 @@ dirtree_load(const char *path,
   if (global_cache_dnp && strcmp(path, global_cache_path) == 0)
       return global_cache_dnp;
   
-  dnp = dirnode_parse(path, descend);
-
-  /* XXX: Make temp filename, write, rename to cpath */
-  fp = fopen(cpath, "w");
-  if (fp)
+  ap = arena_create(0);
+  dnp = dirnode_parse(path, descend, ap);
+  if (!dnp)
   {
-    if (debug)
-      fprintf(stderr, "dirtree_load: creating new cache file: %s\n", cpath);
-    
-    fprintf(fp, "# Cache path: %s\n", cpath);
-    dirnode_save(dnp, fp);
-    fclose(fp);
+    arena_destroy(ap);
+    free(cpath);
+    return NULL;
+  }
 
+  if (dirtree_save(dnp, cpath) == 0)
+  {
     if (global_cache_dnp)
     {
       tdnp = global_cache_dnp;
@@ -1027,7 +1746,7 @@ dirtree_menu_print(DIRNODE *dnp,
 	    url,
 	    dnp->title);
   
-  if (dnp->len && (isopen || !curpath))
+  if ((isopen || !curpath) && dirnode_expand(dnp))
   {
       putc('\n', out);
       if (strcmp(type, "ol") == 0 || strcmp(type, "ul") == 0)
@@ -1051,13 +1770,18 @@ dirtree_menu_print(DIRNODE *dnp,
 }
 
 
+/*
+** The last node of the tree in menu order, into *last_url: the last
+** shown child of the last shown child and so on, so only that chain
+** is expanded. Returns 0 if dnp itself is not shown.
+*/
 int
 dirtree_last_get(DIRNODE *dnp,
 		 const char *curpath,
 		 int level,
 		 char **last_url)
 {
-  int i, len, rlen, rc, isopen;
+  int i, len, rlen, isopen;
   char *url;
   
   
@@ -1075,24 +1799,15 @@ dirtree_last_get(DIRNODE *dnp,
   if (dnp->hidden && !isopen)
     return 0;
 
-  if (0 && strcmp(curpath, dnp->path) == 0)
+  for (i = dirnode_expand(dnp)-1; i >= 0; i--)
+    if (dirtree_last_get(dnp->node[i], curpath, (level < 0 ? 1 : level+1), last_url))
       return 1;
 
   if (*last_url)
       free(*last_url);
   *last_url = strdup(url);
 
-  if (dnp->len && (1 || isopen || !curpath))
-  {
-      for (i = 0; i < dnp->len; i++)
-      {
-	  rc = dirtree_last_get(dnp->node[i], curpath, (level < 0 ? 1 : level+1), last_url);
-	  if (rc)
-	      return rc;
-      }
-  }
-
-  return 0;
+  return 1;
 }
 
 int
@@ -1122,6 +1837,7 @@ dirtree_up_get(DIRNODE *dnp,
   if (strcmp(curpath, dnp->path) == 0)
       return 1;
 
+  dirnode_expand(dnp);
   for (i = 0; i < dnp->len; i++)
   {
       rc = dirtree_up_get(dnp->node[i], curpath, (level < 0 ? 1 : level+1), up_url);
@@ -1137,14 +1853,20 @@ dirtree_up_get(DIRNODE *dnp,
   return 0;
 }
 
+/*
+** The node before curpath in menu order, into *prev_url. Only the
+** nodes on the way to curpath are expanded, and the last chain (see
+** dirtree_last_get()) of the shown node just before each of them.
+*/
 int
 dirtree_prev_get(DIRNODE *dnp,
 		 const char *curpath,
 		 int level,
 		 char **prev_url)
 {
-  int i, len, rlen, rc, isopen;
+  int i, p, len, rlen, isopen;
   char *url;
+  DIRNODE *node;
   
   
   if (!dnp)
@@ -1161,23 +1883,46 @@ dirtree_prev_get(DIRNODE *dnp,
   if (dnp->hidden && !isopen)
     return 0;
 
-  if (strcmp(curpath, dnp->path) == 0)
+  if (curpath && strcmp(curpath, dnp->path) == 0)
       return 1;
 
-  if (*prev_url)
-      free(*prev_url);
-  *prev_url = strdup(url);
+  /* The child curpath is in, if any */
+  dirnode_expand(dnp);
+  for (p = 0; curpath && p < dnp->len; p++)
+  {
+    node = dnp->node[p];
+    len = strlen(node->path);
+    if (strncmp(curpath, node->path, len) == 0 &&
+	(curpath[len] == '/' || curpath[len] == '\0'))
+      break;
+  }
 
-  if (dnp->len && (1 || isopen || !curpath))
+  /* Not here: then it comes after the whole subtree */
+  if (p >= dnp->len)
   {
-      for (i = 0; i < dnp->len; i++)
-      {
-	  rc = dirtree_prev_get(dnp->node[i], curpath, (level < 0 ? 1 : level+1), prev_url);
-	  if (rc)
-	      return rc;
-      }
+    dirtree_last_get(dnp, curpath, level, prev_url);
+    return 0;
+  }
+
+  for (i = p-1; i >= 0; i--)
+    if (dirtree_last_get(dnp->node[i], curpath, (level < 0 ? 1 : level+1), prev_url))
+      break;
+
+  if (i < 0)
+  {
+    if (*prev_url)
+      free(*prev_url);
+    *prev_url = strdup(url);
   }
 
+  if (dirtree_prev_get(dnp->node[p], curpath, (level < 0 ? 1 : level+1), prev_url))
+    return 1;
+
+  /* As if the rest were walked */
+  for (i = dnp->len-1; i > p; i--)
+    if (dirtree_last_get(dnp->node[i], curpath, (level < 0 ? 1 : level+1), prev_url))
+      break;
+
   return 0;
 }
 
@@ -1215,7 +1960,7 @@ dirtree_next_get(DIRNODE *dnp,
   if (strcmp(curpath, dnp->path) == 0)
       *nextflag = 1;
 
-  if (dnp->len && (isopen || !curpath))
+  if ((isopen || !curpath) && dirnode_expand(dnp))
   {
       for (i = 0; i < dnp->len; i++)
       {
@@ -1229,6 +1974,10 @@ dirtree_next_get(DIRNODE *dnp,
 }
 
 
+/*
+** The path of the first node in menu order with the given title.
+** Titles can be anywhere, so this may load the whole tree.
+*/
 const char *
 dirtree_locate(DIRNODE *dnp,
 	       const char *title)
@@ -1246,6 +1995,7 @@ dirtree_locate(DIRNODE *dnp,
     if (strcasecmp(dnp->title, title) == 0)
 	return dnp->path;
     
+    dirnode_expand(dnp);
     for (i = 0; i < dnp->len; i++)
     {
 	url = dirtree_locate(dnp->node[i], title);
@@ -1281,6 +2031,7 @@ dirtree_submenu_print(DIRNODE *dnp,
       fprintf(out, "<%s>\n", type);
   }
   
+  dirnode_expand(dnp);
   for (i = 0; i < dnp->len; i++)
   {
     len = strlen(dnp->node[i]->path);
@@ -1306,7 +2057,7 @@ dirtree_submenu_print(DIRNODE *dnp,
     fprintf(out, "</%s>\n", type);
   
 
-  if (subnode && subnode->len)
+  if (subnode && dirnode_expand(subnode))
   {
 #if 0
     fputs("<div style=\"border-bottom: dashed 1px gray;\"></div>\n", out);
@@ -1471,7 +2222,7 @@ ssi_make_path(char *type,
     if (*file == '/' || strstr(file, "../") != NULL)
       return NULL;
     
-    return fconcat(path_translated_dir, file);
+    return req_fconcat(path_translated_dir, file);
   }
   else if (strcmp(type, "virtual") == 0)
   {
@@ -1479,14 +2230,56 @@ ssi_make_path(char *type,
       return NULL;
 
     if (*file == '/')
-      return fconcat(document_root, file);
+      return req_fconcat(document_root, file);
     else
-      return fconcat(path_translated_dir, file);
+      return req_fconcat(path_translated_dir, file);
   }
 
   return NULL;
 }
 
+/*
+** True if no component of path after its first skip bytes is "." or
+** "..". Glob patterns such as ".[.]" match those past the "../" check
+** of ssi_make_path().
+*/
+static int
+glob_path_ok(const char *path,
+	     size_t skip)
+{
+  const char *cp;
+  size_t len;
+
+  
+  if (strlen(path) < skip)
+    return 0;
+  
+  for (cp = path+skip; *cp; cp += len)
+  {
+    while (*cp == '/')
+      ++cp;
+    len = strcspn(cp, "/");
+    if ((len == 1 && cp[0] == '.') ||
+	(len == 2 && cp[0] == '.' && cp[1] == '.'))
+      return 0;
+  }
+
+  return 1;
+}
+
+/*
+** Add a string to the key of a cached x-table, with its length so
+** that it cannot run into the next one.
+*/
+static void
+key_add(FILE *fp, const char *s)
+{
+  if (s)
+    fprintf(fp, " %lu:%s", (unsigned long) strlen(s), s);
+  else
+    fputs(" -", fp);
+}
+
 void
 fsend(FILE *in, FILE *out)
 {
@@ -1950,6 +2743,77 @@ filter_title(char *start)
 
 	
 
+/*
+** Load the CSV file of an x-table, and filter and sort it as the
+** directive asks. *untilp is lowered to when a date filter would
+** keep other rows, see table_date_filter().
+*/
+static TABLE *
+xtable_load(const char *tpath,
+	    int header,
+	    TWHERE *wp,
+	    const char *filter,
+	    int filter_flags,
+	    int field,
+	    int count,
+	    int rows,
+	    int cols,
+	    int date_field,
+	    int date_range,
+	    int sorttype,
+	    int sortdir,
+	    time_t *untilp,
+	    FILE *out)
+{
+    TABLE *tblp = table_create();
+    time_t until = 0;
+    int c;
+
+
+    /* Only the columns shown, sorted or filtered on are parsed */
+    if (cols > 0 && !(filter && field < 0) &&
+	!(wp && twhere_project(wp, tblp) < 0))
+    {
+	for (c = (count ? 0 : 1); c < cols + (count ? 0 : 1); ++c)
+	    table_project(tblp, c);
+	/* Ties are broken on the row number, shown or not */
+	table_project(tblp, 0);
+	table_project(tblp, field);
+	table_project(tblp, date_field);
+    }
+
+    table_load(tblp, tpath, header ? 1 : 0);
+    if (date_field != -1)
+    {
+	table_date_filter(tblp, date_field, date_range, now, &until);
+	if (until && (!*untilp || until < *untilp))
+	    *untilp = until;
+    }
+
+    if (wp && twhere_filter(wp, tblp) < 0)
+    {
+	fputs(ssi_errmsg, out);
+	tblp->rows = 0;
+    }
+
+    /* Filter first, so that the rows limit is known to apply */
+    if (filter)
+	table_filter(tblp, filter, field, filter_flags);
+
+    if (sorttype != 0)
+    {
+	/* The header line counts towards the rows limit */
+	if (rows > 0)
+	    table_sort_top(tblp, field, sorttype, sortdir,
+			   rows - ((tblp->head && header >= 0) ? 1 : 0));
+	else
+	    table_sort(tblp, field, sorttype, sortdir);
+    }
+
+    return tblp;
+}
+
+
 void
 file_parse(const char *path,
 	   FILE *out,
@@ -1962,6 +2826,7 @@ file_parse(const char *path,
     int got_body = 0;
     int iscgi;
     int local_skip_header = skip_header;
+    size_t aused;
     struct stat sb;
   
 
@@ -2018,7 +2883,7 @@ file_parse(const char *path,
 	}
     }
 
-    while (!stop && fgets(buf, sizeof(buf), fp) != NULL) {
+    while (!stop && !fragment_done && fgets(buf, sizeof(buf), fp) != NULL) {
 	start = buf;
 
 	if (raw < 2)
@@ -2086,13 +2951,14 @@ file_parse(const char *path,
 	    }
 	}
 	
-	while ((cp = strstr(start, "<!--#")) != NULL) {
+	while (!fragment_done && (cp = strstr(start, "<!--#")) != NULL) {
 	    end = strstr(cp, "-->");
 	    if (!end)
 		break;
 
 	    *cp = '\0';
-	    fputs(start, out);
+	    if (!fragment_table)
+		fputs(start, out);
 
 	    *end = '\0';
 	    start = end+3;
@@ -2101,6 +2967,17 @@ file_parse(const char *path,
 	    arg = xstrtok(NULL, " \t=", &tokp);
 	    val = xstrtok(NULL, " \t", &tokp);
 
+	    if (strcmp(cp, "x-table") == 0)
+		++xtable_seen;
+
+	    /* A fragment only needs the includes leading to its table */
+	    if (fragment_table &&
+		strcmp(cp, "config") != 0 && strcmp(cp, "include") != 0 &&
+		!(strcmp(cp, "x-table") == 0 && xtable_seen == fragment_table))
+		continue;
+
+	    aused = arena_used(req_arena);
+	    
 	    if (strcmp(cp, "config") == 0 && arg && val) {
 		if (strcmp(arg, "errmsg") == 0)
 		    ssi_errmsg = strdup(val);
@@ -2127,13 +3004,12 @@ file_parse(const char *path,
 		if (arg && val)
 		    p = ssi_make_path(arg, val);
 		else
-		    p = strdup(path);
+		    p = req_strdup(path);
 
 		if (p && stat(p, &sb) == 0)
 		    fprintf(out, "%lu", sb.st_size);
 		else
 		    fputs(ssi_errmsg, out);
-		free(p);
 	    }
       
 	    else if (strcmp(cp, "flastmod") == 0) {
@@ -2148,7 +3024,6 @@ file_parse(const char *path,
 		    {
 			if (stat(p, &sb) == 0)
 			    dtm = sb.st_mtime;
-			free(p);
 		    }
 		}
 		else
@@ -2168,7 +3043,6 @@ file_parse(const char *path,
 		    file_parse(p, out, 1, gottitle);  /* FIXME! 2 or 1 */
 		else
 		    fputs(ssi_errmsg, out);
-		free(p);
 	    }
       
 	    else if (strcmp(cp, "printenv") == 0) {
@@ -2191,7 +3065,6 @@ file_parse(const char *path,
 		}
 		else
 		    fputs(ssi_errmsg, out);
-		free(p);
 	    }
       
 	    else if (strcmp(cp, "x-href") == 0) {
@@ -2208,19 +3081,19 @@ file_parse(const char *path,
 		    if (strcmp(arg, "base") == 0 && val)
 		    {
 			if (*val == '/')
-			    baseurl = concat(document_root, NULL, val);
+			    baseurl = req_concat(document_root, NULL, val);
 			else
-			    baseurl = concat(path_translated_dir, "/", val);
+			    baseurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    else if (strcmp(arg, "title") == 0 && val)
 		    {
-			title = strdup(val);
+			title = req_strdup(val);
 		    }
 
 		    else if (strcmp(arg, "target") == 0 && val)
 		    {
-			target = strdup(val);
+			target = req_strdup(val);
 		    }
 
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -2262,9 +3135,9 @@ file_parse(const char *path,
 		    if (strcmp(arg, "path") == 0 && val)
 		    {
 			if (*val == '/')
-			    dir = concat(document_root, NULL, val);
+			    dir = req_concat(document_root, NULL, val);
 			else
-			    dir = concat(path_translated_dir, "/", val);
+			    dir = req_concat(path_translated_dir, "/", val);
 			base = val;
 		    }
 
@@ -2278,7 +3151,7 @@ file_parse(const char *path,
 		    }
 		    else if (strcmp(arg, "match") == 0 && val)
 		    {
-			match = strdup(val);
+			match = req_strdup(val);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -2309,15 +3182,15 @@ file_parse(const char *path,
 		    if (strcmp(arg, "path") == 0 && val)
 		    {
 			if (*val == '/')
-			    dir = concat(document_root, NULL, val);
+			    dir = req_concat(document_root, NULL, val);
 			else
-			    dir = concat(path_translated_dir, "/", val);
+			    dir = req_concat(path_translated_dir, "/", val);
 			base = val;
 		    }
 
 		    else if (strcmp(arg, "match") == 0 && val)
 		    {
-			match = strdup(val);
+			match = req_strdup(val);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -2371,9 +3244,9 @@ file_parse(const char *path,
 		    if (strcmp(arg, "base") == 0 && val)
 		    {
 			if (*val == '/')
-			    baseurl = concat(document_root, NULL, val);
+			    baseurl = req_concat(document_root, NULL, val);
 			else
-			    baseurl = concat(path_translated_dir, "/", val);
+			    baseurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -2382,7 +3255,10 @@ file_parse(const char *path,
 	
 		navbar = navbar_create(path_translated_dir, baseurl);
 		if (navbar)
+		{
 		    fputs(navbar, out);
+		    free(navbar);
+		}
 	    }
       
 	    else if (strcmp(cp, "x-titlebar") == 0)
@@ -2395,9 +3271,9 @@ file_parse(const char *path,
 		    if (strcmp(arg, "base") == 0 && val)
 		    {
 			if (*val == '/')
-			    baseurl = concat(document_root, NULL, val);
+			    baseurl = req_concat(document_root, NULL, val);
 			else
-			    baseurl = concat(path_translated_dir, "/", val);
+			    baseurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -2406,13 +3282,16 @@ file_parse(const char *path,
 	
 		titlebar = titlebar_create(path_translated_dir, baseurl);
 		if (titlebar)
+		{
 		    fputs(titlebar, out);
+		    free(titlebar);
+		}
 	    }
 
 	    else if (strcmp(cp, "x-oldtable") == 0 && arg && val)
 	    {
 		char *tpath = NULL, *xp, *yp;
-		char *opts = strdup("");
+		char *opts = "";
 		int variant = 0;
 		char *width=NULL;
 	
@@ -2444,21 +3323,17 @@ file_parse(const char *path,
 			    fputs(ssi_errmsg, out);
 			    break;
 			}
-			width=strdup(val);
+			width = req_strdup(val);
 		    }
 		    else
 		    {
 			if (val && *val)
 			{
-			    yp = concat(arg, "=", val);
-			    xp = concat(opts, " ", yp);
-			    free(yp);
+			    yp = req_concat(arg, "=", val);
+			    opts = req_concat(opts, " ", yp);
 			}
 			else
-			    xp = concat(opts, " ", arg);
-	    
-			free(opts);
-			opts = xp;
+			    opts = req_concat(opts, " ", arg);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -2468,7 +3343,6 @@ file_parse(const char *path,
 		if (tpath)
 		{
 		    table_print_csv(tpath, opts, out, variant, width);
-		    free(tpath);
 		}
 		else
 		    fputs(ssi_errmsg, out);
@@ -2477,11 +3351,13 @@ file_parse(const char *path,
 	    else if (strcmp(cp, "x-table") == 0 && arg && val)
 	    {
 		char *tpath = NULL, *xp, *yp;
-		char *opts = strdup("");
+		char *opts = "";
 		int header = 0;
 		int field = -1;
 		int count = 0;
 		int sorttype = 0;
+		int sortdir = 1;
+		int filter_flags = 0;
 		int date_field = -1;
 		int date_range = 0;
 		int striped = 0;
@@ -2489,19 +3365,44 @@ file_parse(const char *path,
 		int cols = 0;
 		char *width=NULL;
 		char *filter=NULL;
+		char *where=NULL;
+		unsigned long sortmem = 0;
+		int ajax = 0;
+		int print_flags = fragment_json ? TPRINT_JSON : 0;
+		glob_t gl;
+		int merged = 0;
+
+		memset(&gl, 0, sizeof(gl));
 	
 		while (arg && *arg)
 		{
 		    xp = ssi_make_path(arg, val);
 		    if (xp)
 		    {
-			if (tpath)
+			size_t first = tpath ? gl.gl_pathc : 0;
+			size_t i;
+
+			/* Several files, or patterns, make one table of them all */
+			if (glob(xp, GLOB_NOCHECK | (tpath ? GLOB_APPEND : 0), NULL, &gl) != 0)
 			{
 			    fputs(ssi_errmsg, out);
 			    break;
 			}
 
-			tpath = xp;
+			/* The part given (at the end of xp) must stay below its directory */
+			for (i = first; i < gl.gl_pathc; ++i)
+			    if (!glob_path_ok(gl.gl_pathv[i], strlen(xp) - strlen(val)))
+				break;
+			if (i < gl.gl_pathc)
+			{
+			    /* Reported below, as for no file at all */
+			    tpath = NULL;
+			    merged = 0;
+			    break;
+			}
+
+			tpath = gl.gl_pathv[0];
+			merged = (gl.gl_pathc > 1);
 		    }
 	  
 		    else if (strcmp(arg, "header") == 0)
@@ -2585,14 +3486,86 @@ file_parse(const char *path,
 			}
 		    }
 
+		    else if (strcmp(arg, "sortmem") == 0)
+		    {
+			char unit = '\0';
+
+			/* Memory a sort may use, for files larger than that */
+			if (!val || sscanf(val, "%lu%c", &sortmem, &unit) < 1)
+			{
+			    fputs(ssi_errmsg, out);
+			    break;
+			}
+			if (unit == 'k' || unit == 'K')
+			    sortmem <<= 10;
+			else if (unit == 'm' || unit == 'M')
+			    sortmem <<= 20;
+			else if (unit == 'g' || unit == 'G')
+			    sortmem <<= 30;
+		    }
+
+		    else if (strcmp(arg, "order") == 0)
+		    {
+			if (val && strcmp(val, "desc") == 0)
+			    sortdir = -1;
+			else if (val && strcmp(val, "asc") == 0)
+			    sortdir = 1;
+			else
+			{
+			    fputs(ssi_errmsg, out);
+			    break;
+			}
+		    }
+
 		    else if (strcmp(arg, "filter") == 0)
 		    {
 			if (val)
-			    filter = strdup(val);
+			    filter = req_strdup(val);
 			else
 			    filter = NULL;
 		    }
 
+		    else if (strcmp(arg, "where") == 0)
+		    {
+			if (val)
+			    where = req_strdup(val);
+			else
+			    where = NULL;
+		    }
+
+		    else if (strcmp(arg, "icase") == 0)
+		    {
+			int on = 1;
+
+			if (val && sscanf(val, "%d", &on) != 1)
+			{
+			    fputs(ssi_errmsg, out);
+			    break;
+			}
+			filter_flags = on ? (filter_flags | TFILTER_ICASE) : (filter_flags & ~TFILTER_ICASE);
+		    }
+
+		    else if (strcmp(arg, "index") == 0)
+		    {
+			int on = 1;
+
+			if (val && sscanf(val, "%d", &on) != 1)
+			{
+			    fputs(ssi_errmsg, out);
+			    break;
+			}
+			filter_flags = on ? (filter_flags | TFILTER_INDEX) : (filter_flags & ~TFILTER_INDEX);
+		    }
+
+		    else if (strcmp(arg, "ajax") == 0)
+		    {
+			if (val && sscanf(val, "%d", &ajax) != 1)
+			{
+			    fputs(ssi_errmsg, out);
+			    break;
+			}
+		    }
+
 		    else if (strcmp(arg, "cellwidth") == 0)
 		    {
 			if (!val)
@@ -2600,7 +3573,7 @@ file_parse(const char *path,
 			    fputs(ssi_errmsg, out);
 			    break;
 			}
-			width=strdup(val);
+			width = req_strdup(val);
 		    }
 		    else
 		    {
@@ -2608,26 +3581,41 @@ file_parse(const char *path,
 			{
 			    char *tmp;
 
-			    tmp = concat(val, "", "\"");
-			    yp = concat(arg, "=\"", tmp);
-			    xp = concat(opts, " ", yp);
-			    free(yp);
+			    tmp = req_concat(val, "", "\"");
+			    yp = req_concat(arg, "=\"", tmp);
+			    opts = req_concat(opts, " ", yp);
 			}
 			else
-			    xp = concat(opts, " ", arg);
-	    
-			free(opts);
-			opts = xp;
+			    opts = req_concat(opts, " ", arg);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
 		    val = xstrtok(NULL, " \t", &tokp);
 		}
 	
+		/* Tell x-table.js which fragment of the page the table is */
+		if (ajax && xtable_page)
+		{
+		    char nbuf[64];
+
+		    sprintf(nbuf, "data-x-table=\"%d\"", xtable_seen);
+		    opts = req_concat(opts, " ", nbuf);
+		}
+
 		if (tpath)
 		{
 		    int n = -1;
 		    char *ss;
+		    TWHERE *wp = NULL;
+		    struct stat sb;
+		    int query_filter = 0;
+		    int query_view = 0;
+		    char *key = NULL;
+		    size_t keylen;
+		    FILE *kfp, *tout = out;
+		    TFRAG *fragp = NULL;
+		    time_t until = 0;
+		    int cached = 0;
 
 	    
 		    form_init(NULL);
@@ -2635,45 +3623,173 @@ file_parse(const char *path,
 		    if (ss)
 			sscanf(ss, "%d", &n);
 		    if (n != -1)
+		    {
 			sorttype = n;
+			query_view = 1;
+		    }
 
 		    n = -1;
 		    ss = form_get("field");
 		    if (ss)
 			sscanf(ss, "%d", &n);
 		    if (n != -1)
+		    {
 			field = n;
+			query_view = 1;
+		    }
 	    
+		    ss = form_get("order");
+		    if (ss)
+		    {
+			sortdir = (strcmp(ss, "desc") == 0) ? -1 : 1;
+			query_view = 1;
+		    }
+
 		    ss = form_get("filter");
 		    if (ss)
-			filter = strdup(ss);
-	    
-		    TABLE *tblp = table_create();
-		    table_load(tblp, tpath, header ? 1 : 0);
-		    if (date_field != -1)
-			table_date_filter(tblp, date_field, date_range);
+		    {
+			filter = req_strdup(ss);
+			query_filter = 1;
+		    }
 
-#if 0
-		    if (rows > 0 && tblp->rows > rows)
-			tblp->rows = rows; /* XXX: Hack, should free rows... */
-#endif
-		    
-		    if (sorttype != 0)
-			table_sort(tblp, field, sorttype);
-		    
-		    table_print_html(tblp, out, opts, width, filter, field, count, striped, rows, cols,
-				     (header < 0 ? 1 : 0));
-		    /*	    table_free(tblp); */
-		    free(tpath);
+		    ss = form_get("where");
+		    if (ss)
+		    {
+			where = req_strdup(ss);
+			query_filter = 1;
+		    }
+
+		    /*
+		    ** Tables with the same file and arguments come out
+		    ** the same, so they are cached, but not for sorts or
+		    ** filters from the query, which visitors could vary
+		    ** without end into files that are never removed.
+		    */
+		    if (!query_filter && !query_view && !merged &&
+			(kfp = open_memstream(&key, &keylen)) != NULL)
+		    {
+			fprintf(kfp, "%d %d %d %d %d %d %d %d %d %d %d %lu %d",
+				header, field, count, striped, rows, cols,
+				sorttype, sorttype ? sortdir : 0, filter ? filter_flags : 0,
+				date_field, date_field != -1 ? date_range : 0, sortmem,
+				print_flags);
+			key_add(kfp, opts);
+			key_add(kfp, width);
+			key_add(kfp, filter);
+			key_add(kfp, where);
+			key_add(kfp, date_field != -1 ? getenv("TZ") : NULL);
+			key_add(kfp, sorttype ? collate_name() : NULL);
+			if (fclose(kfp) != 0)
+			{
+			    free(key);
+			    key = NULL;
+			}
+		    }
+
+		    /*
+		    ** A fragment asked for by x-table.js is sent as it is
+		    ** made, rather than once all of it is in the cache.
+		    */
+		    if (key && !nocache() && tfrag_send(tpath, key, now, out) == 0)
+			cached = 1;
+		    else if (key && !fragment_table && (fragp = tfrag_open(tpath, key)) != NULL)
+			tout = tfrag_file(fragp);
+
+		    if (cached)
+			;
+
+		    else if (where && (wp = twhere_compile(where)) == NULL)
+			fputs(ssi_errmsg, tout);
+
+		    /* Each file is loaded and sorted (or read from its snapshot and stored sort), then merged */
+		    else if (merged)
+		    {
+			TABLE **tv;
+			size_t i;
+			int late;
+
+			/*
+			** Row numbers run on across the files, so they sort as
+			** numbers: sort=2 on them is taken as sort=3.
+			*/
+			if (field <= 0 && sorttype == 2)
+			    sorttype = 3;
+
+			/*
+			** Filters that could match one are applied to the merged
+			** rows. where= can not test them (see twhere.c), which is
+			** known once the first file has given the column names.
+			*/
+			late = (filter && field <= 0 && filter[strspn(filter, "0123456789")] == '\0');
+
+			tv = calloc(gl.gl_pathc, sizeof(TABLE *));
+			if (tv)
+			{
+			    for (i = 0; i < gl.gl_pathc && !(wp && twhere_uses(wp, 0)); ++i)
+				tv[i] = xtable_load(gl.gl_pathv[i], header, wp,
+						    late ? NULL : filter, filter_flags, field, count,
+						    late ? 0 : rows, (late && field < 0) ? 0 : cols,
+						    date_field, date_range, sorttype, sortdir,
+						    &until, tout);
+			    if (i < gl.gl_pathc)
+				fputs(ssi_errmsg, tout);
+			    else
+				table_merge_html(tv, gl.gl_pathc, tout, opts, width,
+						 late ? filter : NULL, field, count, striped, rows,
+						 cols, (header < 0 ? 1 : 0),
+						 (late ? filter_flags : 0) | print_flags,
+						 sorttype, sortdir);
+			    for (i = 0; i < gl.gl_pathc; ++i)
+				table_free(tv[i]);
+			    free(tv);
+			}
+			else
+			    fputs(ssi_errmsg, tout);
+		    }
+
+		    /* Nothing needs the whole table, so print it as it is read */
+		    else if ((sorttype < 1 || sorttype > 4) && date_field == -1 && !wp &&
+			!(filter && (filter_flags & TFILTER_INDEX)))
+			table_stream_html(tpath, header ? 1 : 0, tout, opts, width, filter, field,
+					  count, striped, rows, cols, (header < 0 ? 1 : 0),
+					  filter_flags | print_flags);
+
+		    /* Files larger than the sort may use are sorted in runs */
+		    else if (sortmem > 0 && date_field == -1 && !wp &&
+			     stat(tpath, &sb) == 0 && (unsigned long) sb.st_size > sortmem)
+			table_xsort_html(tpath, header ? 1 : 0, tout, opts, width, filter, field,
+					 count, striped, rows, cols, (header < 0 ? 1 : 0),
+					 filter_flags | print_flags, sorttype, sortdir, sortmem);
+		    else
+		    {
+			TABLE *tblp;
+
+			tblp = xtable_load(tpath, header, wp, filter, filter_flags, field, count,
+					   rows, cols, date_field, date_range, sorttype, sortdir,
+					   &until, tout);
+			table_print_html(tblp, tout, opts, width, NULL, field, count, striped, rows, cols,
+					 (header < 0 ? 1 : 0), print_flags);
+			table_free(tblp);
+		    }
+		    twhere_free(wp);
+
+		    if (fragp)
+			tfrag_close(fragp, until, out);
+		    free(key);
 		}
 		else
 		    fputs(ssi_errmsg, out);
+
+		globfree(&gl);
+
+		if (fragment_table)
+		    fragment_done = 1;
 	    }
       
 	    else if (strcmp(cp, "x-calendar") == 0 && arg && val)
 	    {
 		char *tpath = NULL, *xp, *yp;
-		char *opts = strdup("");
+		char *opts = "";
 		int year, month, cols;
 		struct tm *tp;
 
@@ -2721,11 +3837,8 @@ file_parse(const char *path,
 		    }
 		    else
 		    {
-			yp = concat(arg, "=", val);
-			xp = concat(opts, " ", yp);
-			free(yp);
-			free(opts);
-			opts = xp;
+			yp = req_concat(arg, "=", val);
+			opts = req_concat(opts, " ", yp);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -2735,7 +3848,6 @@ file_parse(const char *path,
 		if (tpath)
 		{
 		    calendar_print_csv(tpath, year, month, cols, opts, out);
-		    free(tpath);
 		}
 		else
 		    fputs(ssi_errmsg, out);
@@ -2760,24 +3872,24 @@ file_parse(const char *path,
 			if (!val || !*val || strcmp(val, "ALL") == 0)
 			    openurl = NULL;
 			else if (*val == '/')
-			    openurl = concat(document_root, NULL, val);
+			    openurl = req_concat(document_root, NULL, val);
 			else
-			    openurl = concat(path_translated_dir, "/", val);
+			    openurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    else if (strcmp(arg, "base") == 0 && val)
 		    {
 			if (*val == '/')
-			    baseurl = concat(document_root, NULL, val);
+			    baseurl = req_concat(document_root, NULL, val);
 			else
-			    baseurl = concat(path_translated_dir, "/", val);
+			    baseurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    else if (strcmp(arg, "type") == 0 && val)
-			type = strdup(val);
+			type = req_strdup(val);
 	  
 		    else if (strcmp(arg, "style") == 0 && val)
-			style = strdup(val);
+			style = req_strdup(val);
 
 		    arg = xstrtok(NULL, " \t=", &tokp);
 		    val = xstrtok(NULL, " \t", &tokp);
@@ -2807,24 +3919,24 @@ file_parse(const char *path,
 			if (!val || !*val || strcmp(val, "ALL") == 0)
 			    openurl = NULL;
 			else if (*val == '/')
-			    openurl = concat(document_root, NULL, val);
+			    openurl = req_concat(document_root, NULL, val);
 			else
-			    openurl = concat(path_translated_dir, "/", val);
+			    openurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    else if (strcmp(arg, "base") == 0 && val)
 		    {
 			if (*val == '/')
-			    baseurl = concat(document_root, NULL, val);
+			    baseurl = req_concat(document_root, NULL, val);
 			else
-			    baseurl = concat(path_translated_dir, "/", val);
+			    baseurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    else if (strcmp(arg, "type") == 0 && val)
-			type = strdup(val);
+			type = req_strdup(val);
 	  
 		    else if (strcmp(arg, "style") == 0 && val)
-			style = strdup(val);
+			style = req_strdup(val);
 
 		    arg = xstrtok(NULL, " \t=", &tokp);
 		    val = xstrtok(NULL, " \t", &tokp);
@@ -2852,17 +3964,17 @@ file_parse(const char *path,
 			if (!val || !*val || strcmp(val, "ALL") == 0)
 			    openurl = NULL;
 			else if (*val == '/')
-			    openurl = concat(document_root, NULL, val);
+			    openurl = req_concat(document_root, NULL, val);
 			else
-			    openurl = concat(path_translated_dir, "/", val);
+			    openurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    else if (strcmp(arg, "base") == 0 && val)
 		    {
 			if (*val == '/')
-			    baseurl = concat(document_root, NULL, val);
+			    baseurl = req_concat(document_root, NULL, val);
 			else
-			    baseurl = concat(path_translated_dir, "/", val);
+			    baseurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -2899,17 +4011,17 @@ file_parse(const char *path,
 			if (!val || !*val || strcmp(val, "ALL") == 0)
 			    openurl = NULL;
 			else if (*val == '/')
-			    openurl = concat(document_root, NULL, val);
+			    openurl = req_concat(document_root, NULL, val);
 			else
-			    openurl = concat(path_translated_dir, "/", val);
+			    openurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    else if (strcmp(arg, "base") == 0 && val)
 		    {
 			if (*val == '/')
-			    baseurl = concat(document_root, NULL, val);
+			    baseurl = req_concat(document_root, NULL, val);
 			else
-			    baseurl = concat(path_translated_dir, "/", val);
+			    baseurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -2946,17 +4058,17 @@ file_parse(const char *path,
 			if (!val || !*val || strcmp(val, "ALL") == 0)
 			    openurl = NULL;
 			else if (*val == '/')
-			    openurl = concat(document_root, NULL, val);
+			    openurl = req_concat(document_root, NULL, val);
 			else
-			    openurl = concat(path_translated_dir, "/", val);
+			    openurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    else if (strcmp(arg, "base") == 0 && val)
 		    {
 			if (*val == '/')
-			    baseurl = concat(document_root, NULL, val);
+			    baseurl = req_concat(document_root, NULL, val);
 			else
-			    baseurl = concat(path_translated_dir, "/", val);
+			    baseurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -2993,17 +4105,17 @@ file_parse(const char *path,
 			if (!val || !*val || strcmp(val, "ALL") == 0)
 			    openurl = NULL;
 			else if (*val == '/')
-			    openurl = concat(document_root, NULL, val);
+			    openurl = req_concat(document_root, NULL, val);
 			else
-			    openurl = concat(path_translated_dir, "/", val);
+			    openurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    else if (strcmp(arg, "base") == 0 && val)
 		    {
 			if (*val == '/')
-			    baseurl = concat(document_root, NULL, val);
+			    baseurl = req_concat(document_root, NULL, val);
 			else
-			    baseurl = concat(path_translated_dir, "/", val);
+			    baseurl = req_concat(path_translated_dir, "/", val);
 		    }
 	  
 		    arg = xstrtok(NULL, " \t=", &tokp);
@@ -3089,7 +4201,6 @@ file_parse(const char *path,
 		    file_parse(p, out, 0, gottitle);
 		else
 		    fputs(ssi_errmsg, out);
-		free(p);
 	    }
       
 	    else if (strcmp(cp, "x-head") == 0) {
@@ -3109,7 +4220,6 @@ file_parse(const char *path,
 		    }
 		    else
 			fputs(ssi_errmsg, out);
-		    free(p);
 		}
 		else
 		{
@@ -3130,15 +4240,18 @@ file_parse(const char *path,
 		    file_write(p, out);
 		else
 		    fputs(ssi_errmsg, out);
-
-		free(p);
 	    }
 
 	    else
 		fputs(ssi_errmsg, out);
+
+	    if (debug)
+		fprintf(stderr, "file_parse: %s: %lu bytes\n",
+			cp, (unsigned long) (arena_used(req_arena) - aused));
 	}
     
-	fputs(start, out);
+	if (!fragment_table)
+	    fputs(start, out);
     }
 
     if (iscgi)
@@ -3148,6 +4261,496 @@ file_parse(const char *path,
 }
 
 
+#ifdef __linux__
+/*
+** Watch mode (index --watch DOCROOT): keep the whole tree in memory,
+** follow changes via inotify, and rewrite only the cache files that
+** hold the changed nodes. While the heartbeat file is kept fresh,
+** renderers treat existing cache files as current and never crawl,
+** so cache files that renderers write later are taken over as shards.
+*/
+
+#define WATCH_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_CLOSE_WRITE|IN_ATTRIB)
+
+static char **watch_dir = NULL;
+static int watch_size = 0;
+
+/* Nodes dropped from the tree but still held by its arena */
+static int watch_garbage = 0;
+
+
+void
+watch_add_tree(int ifd,
+	       const char *path)
+{
+  DIR *dp;
+  struct dirent *dep;
+  struct stat sb;
+  char *tpath;
+  int wd;
+
+  
+  wd = inotify_add_watch(ifd, path, WATCH_MASK|IN_ONLYDIR);
+  if (wd < 0)
+  {
+    fprintf(stderr, "watch: inotify_add_watch(%s) failed: %s\n", path, strerror(errno));
+    return;
+  }
+
+  if (wd >= watch_size)
+  {
+    int n = wd+256;
+
+    watch_dir = realloc(watch_dir, n * sizeof(watch_dir[0]));
+    if (!watch_dir)
+      abort();
+    memset(watch_dir+watch_size, 0, (n-watch_size) * sizeof(watch_dir[0]));
+    watch_size = n;
+  }
+  
+  if (watch_dir[wd])
+    free(watch_dir[wd]);
+  watch_dir[wd] = strdup(path);
+
+  dp = opendir(path);
+  if (!dp)
+    return;
+  
+  while ((dep = readdir(dp)) != NULL)
+  {
+    if (strcmp(dep->d_name, ".") == 0 ||
+	strcmp(dep->d_name, "..") == 0)
+      continue;
+
+    tpath = fconcat(path, dep->d_name);
+    if (lstat(tpath, &sb) == 0 && S_ISDIR(sb.st_mode))
+      watch_add_tree(ifd, tpath);
+    free(tpath);
+  }
+  closedir(dp);
+}
+
+
+/*
+** Locate the node for path. On return *parent is the deepest node
+** above path, and *owner the node whose cache file holds the entry
+** for path.
+*/
+DIRNODE *
+watch_lookup(DIRNODE *dnp,
+	     const char *path,
+	     DIRNODE **parent,
+	     DIRNODE **owner)
+{
+  int i, len;
+  DIRNODE *node;
+
+  
+  *parent = NULL;
+  *owner = dnp;
+  
+  while (dnp)
+  {
+    if (strcmp(dnp->path, path) == 0)
+      return dnp;
+
+    node = NULL;
+    for (i = 0; i < dnp->len && !node; i++)
+    {
+      len = strlen(dnp->node[i]->path);
+      if (strncmp(path, dnp->node[i]->path, len) == 0 &&
+	  (path[len] == '/' || path[len] == '\0'))
+	node = dnp->node[i];
+    }
+    
+    *parent = dnp;
+    if (dnp->shard)
+      *owner = dnp;
+    dnp = node;
+  }
+
+  return NULL;
+}
+
+
+void
+watch_dirty(char ***dv,
+	    int *dc,
+	    DIRNODE *dnp)
+{
+  int i;
+
+  
+  for (i = 0; i < *dc; i++)
+    if (strcmp((*dv)[i], dnp->path) == 0)
+      return;
+
+  *dv = realloc(*dv, (*dc+1) * sizeof(char *));
+  if (!*dv)
+    abort();
+  (*dv)[(*dc)++] = strdup(dnp->path);
+}
+
+
+/* Like dirtree_count(), but the daemon holds shards in full */
+int
+watch_count(DIRNODE *dnp)
+{
+  int i, n;
+
+  
+  n = 1;
+  for (i = 0; i < dnp->len; i++)
+    n += watch_count(dnp->node[i]);
+  
+  return n;
+}
+
+
+void
+watch_remove(DIRNODE *parent,
+	     DIRNODE *dnp)
+{
+  int i;
+
+  
+  for (i = 0; i < parent->len && parent->node[i] != dnp; i++)
+    ;
+  if (i >= parent->len)
+    return;
+  
+  for (--parent->len; i < parent->len; i++)
+    parent->node[i] = parent->node[i+1];
+  parent->nsub = parent->len;
+  
+  watch_garbage += watch_count(dnp);
+}
+
+
+void
+watch_insert(DIRNODE *parent,
+	     DIRNODE *dnp)
+{
+  dirnode_add(parent, dnp);
+  parent->nsub = parent->len;
+  
+  dirnode_sort(parent);
+}
+
+
+/*
+** Re-read the node for directory path (its title, hidden flag and, if
+** it is new, its whole subtree) and patch it into the tree.
+*/
+void
+watch_update(DIRNODE *root,
+	     const char *path,
+	     char ***dv,
+	     int *dc)
+{
+  DIRNODE *dnp, *parent, *owner, *node;
+  char *cp, *title, *hpath;
+  int len;
+
+  
+  dnp = watch_lookup(root, path, &parent, &owner);
+
+  if (!dnp)
+  {
+    /* Only directories right below an existing node can appear */
+    cp = strrchr(path, '/');
+    len = cp ? cp-path : 0;
+    if (!parent || (int) strlen(parent->path) != len ||
+	strncmp(parent->path, path, len) != 0)
+      return;
+    
+    node = dirnode_parse(path, -1, root->arena);
+    if (!node)
+      return;
+
+    if (debug)
+      fprintf(stderr, "watch: added %s\n", path);
+    
+    watch_insert(parent, node);
+    watch_dirty(dv, dc, owner);
+    return;
+  }
+
+  hpath = fconcat(dnp->path, "index.html");
+  title = file_get_section(hpath, "title");
+  free(hpath);
+
+  if (!title)
+  {
+    if (parent)
+    {
+      if (debug)
+	fprintf(stderr, "watch: removed %s\n", path);
+      
+      watch_remove(parent, dnp);
+      watch_dirty(dv, dc, owner);
+    }
+    return;
+  }
+  
+  dnp->title = arena_strdup(dnp->arena, title);
+  dnp->key = NULL;
+  free(title);
+  if (!dnp->title)
+    abort();
+
+  hpath = fconcat(dnp->path, ".hidden");
+  dnp->hidden = (access(hpath, R_OK) == 0);
+  free(hpath);
+  
+  if (parent)
+    dirnode_sort(parent);
+  
+  if (debug)
+    fprintf(stderr, "watch: updated %s\n", path);
+  
+  watch_dirty(dv, dc, owner);
+  if (dnp->shard)
+    watch_dirty(dv, dc, dnp);
+}
+
+
+void
+watch_save(DIRNODE *dnp)
+{
+  char *cpath;
+
+  
+  if (!dnp)
+    return;
+  
+  cpath = fconcat(dnp->path, ".cache");
+  dirtree_save(dnp, cpath);
+  free(cpath);
+}
+
+
+/*
+** Mark nodes that already have a .cache file of their own as shards,
+** so that those files are kept up to date too, and write them.
+*/
+void
+watch_shards(DIRNODE *dnp,
+	     int level)
+{
+  char *cpath;
+  int i;
+
+  
+  for (i = 0; i < dnp->len; i++)
+    watch_shards(dnp->node[i], level+1);
+
+  cpath = fconcat(dnp->path, ".cache");
+  if (level > 0 && access(cpath, F_OK) == 0)
+    dirtree_save(dnp, cpath);
+  free(cpath);
+}
+
+
+DIRNODE *
+watch_load(const char *path)
+{
+  DIRNODE *dnp;
+  ARENA *ap;
+
+  
+  ap = arena_create(0);
+  dnp = dirnode_parse(path, -1, ap);
+  if (!dnp)
+  {
+    arena_destroy(ap);
+    return NULL;
+  }
+  
+  watch_garbage = 0;
+  watch_shards(dnp, 0);
+  watch_save(dnp);
+  return dnp;
+}
+
+
+void
+watch_heartbeat(const char *hpath)
+{
+  FILE *fp;
+
+  fp = fopen(hpath, "w");
+  if (fp)
+  {
+    fprintf(fp, "%u\n", (unsigned int) getpid());
+    fclose(fp);
+  }
+}
+
+
+int
+dirtree_watch(const char *path)
+{
+  DIRNODE *root;
+  char *hpath, *dpath;
+  char **dv = NULL;
+  int dc = 0;
+  char buf[65536];
+  struct inotify_event *ep;
+  struct timeval tv;
+  fd_set rs;
+  int ifd, i, n;
+  DIRNODE *dnp, *parent, *owner;
+
+  
+  /* The in-memory tree must be complete, not built from shards */
+  http_cache_control = "no-cache";
+  document_root = (char *) path;
+  time(&now);
+  
+  ifd = inotify_init();
+  if (ifd < 0)
+    fail("inotify_init", NULL);
+
+  watch_add_tree(ifd, path);
+  
+  root = watch_load(path);
+  if (!root)
+    fail("dirnode_parse", path);
+
+  hpath = fconcat(root->path, ".cache.watch");
+  watch_heartbeat(hpath);
+
+  if (debug)
+    fprintf(stderr, "watch: watching %s\n", root->path);
+  
+  for (;;)
+  {
+    FD_ZERO(&rs);
+    FD_SET(ifd, &rs);
+    tv.tv_sec = WATCH_HEARTBEAT;
+    tv.tv_usec = 0;
+
+    n = select(ifd+1, &rs, NULL, NULL, &tv);
+    time(&now);
+    
+    if (n < 0 && errno != EINTR)
+      fail("select", NULL);
+    
+    if (n <= 0)
+    {
+      watch_heartbeat(hpath);
+      continue;
+    }
+
+    n = read(ifd, buf, sizeof(buf));
+    if (n < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      fail("read", NULL);
+    }
+    
+    for (i = 0; i < n; i += sizeof(*ep) + ep->len)
+    {
+      ep = (struct inotify_event *) (buf+i);
+
+      if (ep->mask & IN_Q_OVERFLOW)
+      {
+	fprintf(stderr, "watch: event queue overflow, reloading\n");
+	dirtree_free(root);
+	root = watch_load(path);
+	if (!root)
+	  fail("dirnode_parse", path);
+	continue;
+      }
+      
+      if (ep->mask & IN_IGNORED)
+      {
+	if (ep->wd < watch_size && watch_dir[ep->wd])
+	{
+	  free(watch_dir[ep->wd]);
+	  watch_dir[ep->wd] = NULL;
+	}
+	continue;
+      }
+
+      if (ep->wd >= watch_size || !watch_dir[ep->wd] || !ep->len)
+	continue;
+
+      if (ep->mask & IN_ISDIR)
+      {
+	dpath = fconcat(watch_dir[ep->wd], ep->name);
+	
+	if (ep->mask & (IN_CREATE|IN_MOVED_TO))
+	{
+	  watch_add_tree(ifd, dpath);
+	  watch_update(root, dpath, &dv, &dc);
+	}
+	else if (ep->mask & (IN_DELETE|IN_MOVED_FROM))
+	{
+	  dnp = watch_lookup(root, dpath, &parent, &owner);
+	  if (dnp && parent)
+	  {
+	    if (debug)
+	      fprintf(stderr, "watch: removed %s\n", dpath);
+	    
+	    watch_remove(parent, dnp);
+	    watch_dirty(&dv, &dc, owner);
+	  }
+	}
+	
+	free(dpath);
+      }
+      else if (strcmp(ep->name, "index.html") == 0 ||
+	       strcmp(ep->name, ".hidden") == 0)
+	watch_update(root, watch_dir[ep->wd], &dv, &dc);
+
+      /* A cache file not written by us, which must be kept up to date */
+      else if (strcmp(ep->name, ".cache") == 0 &&
+	       (ep->mask & (IN_CREATE|IN_MOVED_TO)))
+      {
+	dnp = watch_lookup(root, watch_dir[ep->wd], &parent, &owner);
+	if (dnp && !dnp->shard)
+	{
+	  if (debug)
+	    fprintf(stderr, "watch: new shard %s\n", dnp->path);
+
+	  dnp->shard = 1;
+	  watch_dirty(&dv, &dc, dnp);
+	  watch_dirty(&dv, &dc, owner);
+	}
+      }
+    }
+
+    /* Write back the cache files that hold changed nodes */
+    while (dc > 0)
+    {
+      --dc;
+      dnp = watch_lookup(root, dv[dc], &parent, &owner);
+      watch_save(dnp);
+      free(dv[dc]);
+    }
+
+    /* Start over with a fresh arena once most of it is dead */
+    if (watch_garbage > watch_count(root))
+    {
+      if (debug)
+	fprintf(stderr, "watch: compacting tree\n");
+      dirtree_free(root);
+      root = watch_load(path);
+      if (!root)
+	fail("dirnode_parse", path);
+    }
+    
+    watch_heartbeat(hpath);
+  }
+
+  return 0;
+}
+#endif
+
+
 void
 sigalrm_handler(int sig)
 {
@@ -3234,6 +4837,7 @@ main(int argc, char *argv[])
 
   time(&now);
   srand(now*getpid());
+  collate_init();
 
   header_path = footer_path = NULL;
   
@@ -3250,6 +4854,9 @@ main(int argc, char *argv[])
     else if (strcmp(argv[i], "x-raw") == 0)
       ++raw;
 
+    else if (strcmp(argv[i], "x-lazy") == 0)
+      ++lazy_tree;
+
     else
       continue;
 
@@ -3261,6 +4868,27 @@ main(int argc, char *argv[])
     --argc;
     --i;
   }
+
+  if (argc > 1 && strcmp(argv[1], "--watch") == 0)
+  {
+    if (argc != 3)
+    {
+      fprintf(stderr, "Usage: %s [x-debug] --watch DOCROOT\n", argv[0]);
+      exit(1);
+    }
+    
+    alarm(0);
+#ifdef __linux__
+    exit(dirtree_watch(argv[2]));
+#else
+    fprintf(stderr, "%s: --watch is only supported on Linux\n", argv[0]);
+    exit(1);
+#endif
+  }
+
+  req_arena = arena_create(0);
+  if (!req_arena)
+    fail("arena_create", NULL);
   
   env_get();
 
@@ -3319,7 +4947,20 @@ main(int argc, char *argv[])
 	    "path_translated = %s\n, path_translated_dir = %s\n, path_info = %s\nnowrap = %d, raw = %d\n",
 	    path_translated, path_translated_dir, path_info, nowrap, raw);
 
-  puts("Content-Type: text/html\n");
+  cp = form_peek("x-fragment");
+  if (cp && !raw)
+  {
+    if (sscanf(cp, "table:%d%n", &fragment_table, &j) == 1 && fragment_table > 0)
+      fragment_json = (strcmp(cp+j, ":json") == 0);
+    else
+      fragment_table = 0;
+  }
+  free(cp);
+
+  if (fragment_json)
+    puts("Content-Type: application/json\n");
+  else
+    puts("Content-Type: text/html\n");
   fflush(stdout);
 
   j = strlen(path_info);
@@ -3342,6 +4983,23 @@ main(int argc, char *argv[])
 	      header_path, footer_path);
 	       
   }
+
+  if (fragment_table)
+  {
+    /*
+    ** Just the one table, without the rest of the page around it,
+    ** but counting the same x-tables as the whole page does.
+    */
+    skip_header = (header_path && access(header_path, R_OK) == 0);
+    skip_footer = (footer_path && access(footer_path, R_OK) == 0);
+    xtable_page = 1;
+    file_parse(index_path, stdout, 0, &got_title);
+
+    if (!fragment_done)
+      fputs(fragment_json ? "[]\n" : ssi_errmsg, stdout);
+    do_accesslog();
+    return 0;
+  }
   
   index_title = file_get_section(index_path, "title");
   index_head = file_get_section(index_path, "head");
@@ -3355,10 +5013,13 @@ main(int argc, char *argv[])
   if (footer_path && access(footer_path, R_OK) == 0)
     skip_footer = 1;
 
+  xtable_seen = 0;
+  xtable_page = 1;
   if (!raw)
     file_parse(index_path, stdout, 0, &got_title);
   else
     file_write(index_path, stdout);
+  xtable_page = 0;
   
   free(index_path);
 
@@ -3368,6 +5029,11 @@ main(int argc, char *argv[])
       file_parse(footer_path, stdout, 0, &got_title);
       free(footer_path);
   }
+
+  if (debug)
+    fprintf(stderr, "*** Index: Request arena: %lu bytes\n",
+	    (unsigned long) arena_used(req_arena));
+  arena_reset(req_arena);
   
   if (debug > 1)
   {
@@ -1,15 +1,38 @@
 /*
 ** table.c
+**
+** Tables are stored by column: every cell string lives in one heap
+** and each column holds the heap offsets of its cells, plus the
+** numeric values of the cells, parsed once when the table is loaded.
+** Sorting and filtering only reorder the row view (tp->row).
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "html.h"
 #include "table.h"
+#include "tsort.h"
+#include "tsnap.h"
+#include "tgram.h"
 #include "csv.h"
+#include "collate.h"
+
+
+#define CELL(tp,r,c)	TABLE_CELL(tp,r,c)
+
+/* Guards making the row numbers of a table, which sort threads may ask for */
+static pthread_mutex_t rownum_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 TABLE *
 table_create(void)
@@ -27,134 +50,1955 @@ table_create(void)
 void
 table_free(TABLE *tp)
 {
-    int r, c;
+    int c;
 
     if (!tp)
 	return;
-    
-    if (tp->head)
-	for (c = 0; tp->head[c]; ++c)
-	    free(tp->head);
 
-    if (tp->cell)
+    free(tp->nums);
+    free(tp->itab);
+
+    if (tp->map)
+    {
+	munmap(tp->map, tp->maplen);
+	free(tp->col);
+	free(tp->row);
+	free(tp->need);
+	free(tp->path);
+	free(tp);
+	return;
+    }
+
+    for (c = 0; c < tp->cols; ++c)
+    {
+	free(tp->col[c].off);
+	free(tp->col[c].flags);
+	free(tp->col[c].ival);
+	free(tp->col[c].dval);
+    }
+    free(tp->col);
+    free(tp->head);
+    free(tp->len);
+    free(tp->row);
+    free(tp->heap);
+    free(tp->need);
+    free(tp->path);
+    free(tp);
+}
+
+const char *
+table_cell(TABLE *tp,
+	   int row,
+	   int col)
+{
+    if (!tp || row < 0 || row >= tp->nrows || col < 0)
+	return NULL;
+
+    return CELL(tp, row, col);
+}
+
+/* Offset of row number n (> 0) in the strings "1", "2", ... */
+static size_t
+rownum_off(unsigned int n)
+{
+    size_t off = 0, lo, d;
+
+
+    for (d = 2, lo = 1; lo * 10 <= n; ++d, lo *= 10)
+	off += 9 * lo * d;
+
+    return off + (n - lo) * d;
+}
+
+/*
+** Cell 0 of stored row r: its row number, r+1. The strings of all
+** row numbers are made on first use, as few views need them.
+*/
+const char *
+table_rownum(TABLE *tp,
+	     int r)
+{
+    char *nums, *p, digits[16];
+    int n, i, nd = 1;
+
+
+    nums = __atomic_load_n(&tp->nums, __ATOMIC_ACQUIRE);
+    if (!nums)
     {
-	for (r = 0; tp->cell[r]; ++r)
+	pthread_mutex_lock(&rownum_lock);
+	nums = tp->nums;
+	if (!nums && (nums = malloc(rownum_off(tp->nrows + 1) + 1)) != NULL)
 	{
-	    for (c = 0; tp->cell[r][c]; ++c)
-		free(tp->cell[r][c]);
-	    free(tp->cell[r]);
+	    /* Counted up in decimal, rather than printed one by one */
+	    digits[0] = '0';
+	    for (p = nums, n = 1; n <= tp->nrows; ++n)
+	    {
+		for (i = nd - 1; i >= 0 && digits[i] == '9'; --i)
+		    digits[i] = '0';
+		if (i >= 0)
+		    ++digits[i];
+		else
+		{
+		    memmove(digits + 1, digits, nd++);
+		    digits[0] = '1';
+		}
+		memcpy(p, digits, nd);
+		p[nd] = '\0';
+		p += nd + 1;
+	    }
+	    __atomic_store_n(&tp->nums, nums, __ATOMIC_RELEASE);
 	}
-	free(tp->cell);
+	pthread_mutex_unlock(&rownum_lock);
+
+	if (!nums)
+	    return "";
     }
-    free(tp);
+
+    return nums + rownum_off(r + 1);
+}
+
+
+static unsigned int
+heap_add(TABLE *tp,
+	 const char *s,
+	 size_t len)
+{
+    size_t size;
+    unsigned int off;
+    char *nheap;
+
+
+    if (tp->heaplen + len + 1 >= TCELL_NONE)
+	return TCELL_NONE;
+
+    if (tp->heaplen + len + 1 > tp->heapsize)
+    {
+	size = tp->heapsize ? tp->heapsize : 65536;
+	while (size < tp->heaplen + len + 1)
+	    size *= 2;
+
+	nheap = realloc(tp->heap, size);
+	if (!nheap)
+	    return TCELL_NONE;
+	tp->heap = nheap;
+	tp->heapsize = size;
+    }
+
+    off = tp->heaplen;
+    memcpy(tp->heap + off, s, len);
+    tp->heap[off + len] = '\0';
+    tp->heaplen += len + 1;
+
+    return off;
+}
+
+/* FNV-1a, for interning */
+static uint32_t
+str_hash(const char *s,
+	 size_t len)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
+
+
+    for (i = 0; i < len; ++i)
+	h = (h ^ (unsigned char) s[i]) * 16777619U;
+    return h;
+}
+
+/*
+** Add a cell string to the heap, or give the same string added
+** before, so that repeated values (categories, states, dates) are
+** only stored once.
+*/
+static unsigned int
+heap_intern(TABLE *tp,
+	    const char *s,
+	    size_t len)
+{
+    unsigned int *ntab, off;
+    size_t i, j, size;
+
+
+    if (tp->icount * 2 >= tp->isize)
+    {
+	size = tp->isize ? tp->isize * 2 : 4096;
+	ntab = malloc(size * sizeof(unsigned int));
+	if (!ntab)
+	    return heap_add(tp, s, len);
+	memset(ntab, 0xFF, size * sizeof(unsigned int));
+
+	for (i = 0; i < tp->isize; ++i)
+	{
+	    off = tp->itab[i];
+	    if (off == TCELL_NONE)
+		continue;
+	    j = str_hash(tp->heap + off, strlen(tp->heap + off)) & (size - 1);
+	    while (ntab[j] != TCELL_NONE)
+		j = (j + 1) & (size - 1);
+	    ntab[j] = off;
+	}
+
+	free(tp->itab);
+	tp->itab = ntab;
+	tp->isize = size;
+    }
+
+    for (i = str_hash(s, len) & (tp->isize - 1);
+	 (off = tp->itab[i]) != TCELL_NONE;
+	 i = (i + 1) & (tp->isize - 1))
+	if (off + len < tp->heaplen && tp->heap[off + len] == '\0' &&
+	    memcmp(tp->heap + off, s, len) == 0)
+	    return off;
+
+    off = heap_add(tp, s, len);
+    if (off != TCELL_NONE)
+    {
+	tp->itab[i] = off;
+	++tp->icount;
+    }
+    return off;
+}
+
+static int
+grow_rows(TABLE *tp)
+{
+    int c, r, maxrows;
+    int *nlen;
+    unsigned int *noff;
+
+
+    maxrows = tp->maxrows ? tp->maxrows * 2 : 128;
+
+    nlen = realloc(tp->len, maxrows * sizeof(int));
+    if (!nlen)
+	return -1;
+    tp->len = nlen;
+
+    for (c = 0; c < tp->cols; ++c)
+    {
+	noff = realloc(tp->col[c].off, maxrows * sizeof(unsigned int));
+	if (!noff)
+	    return -1;
+	for (r = tp->maxrows; r < maxrows; ++r)
+	    noff[r] = TCELL_NONE;
+	tp->col[c].off = noff;
+    }
+
+    tp->maxrows = maxrows;
+    return 0;
+}
+
+static int
+add_col(TABLE *tp)
+{
+    TCOLUMN *ncol;
+    int r;
+
+
+    if (tp->cols >= tp->maxcols)
+    {
+	ncol = realloc(tp->col, (tp->maxcols + 16) * sizeof(TCOLUMN));
+	if (!ncol)
+	    return -1;
+	tp->col = ncol;
+	tp->maxcols += 16;
+    }
+
+    memset(&tp->col[tp->cols], 0, sizeof(TCOLUMN));
+    tp->col[tp->cols].off = malloc(tp->maxrows * sizeof(unsigned int));
+    if (tp->maxrows && !tp->col[tp->cols].off)
+	return -1;
+    for (r = 0; r < tp->maxrows; ++r)
+	tp->col[tp->cols].off[r] = TCELL_NONE;
+
+    return tp->cols++;
 }
 
-static char **
-getrow(CSV *cp, int row)
+
+/*
+** Read one row into the heap, with the row number as cell 0 (only
+** stored for the header row, see table_rownum()). Repeated cell
+** strings are stored once. Cells of columns that are not needed are
+** not copied but get the (empty) heap string skip, unless that is
+** TCELL_NONE. Returns the
+** number of cells, 0 at end of file (a last line without a newline
+** is dropped) or -1 on errors.
+*/
+static int
+getrow(TABLE *tp,
+       CSVMAP *mp,
+       int row,
+       unsigned int skip,
+       unsigned int **cvp,
+       int *maxcvp)
 {
-    char **ncv, **cv = NULL, *cell;
-    int maxcols = 0;
+    char buf[32];
+    char *s = buf;
+    unsigned int *ncv;
+    size_t start = tp->heaplen;
     int col = 0;
-    int rc = -1;
-    int i;
-    char buf[256];
-    
+    int rc;
 
-    cv = calloc(sizeof(char *), maxcols = 64);
-    if (!cv)
-	return NULL;
 
-    sprintf(buf, "%u", row);
-    cell = strdup(buf);
-    rc = 1;
-    
+    rc = sprintf(buf, "%u", row);
+
     while (rc >= 0)
     {
-	if (!cell)
-	    cell = strdup("");
-	
-	if (col+1 >= maxcols)
+	if (col >= *maxcvp)
 	{
-	    ncv = calloc(sizeof(char *), maxcols += 16);
+	    ncv = realloc(*cvp, (*maxcvp + 64) * sizeof(unsigned int));
 	    if (!ncv)
-	    {
-		if (cv)
-		    free(cv);
-		return NULL;
-	    }
-	    
-	    if (cv)
-	    {
-		for (i = 0; i < col; i++)
-		    ncv[i] = cv[i];
-		free(cv);
-	    }
-	    cv = ncv;
+		goto Fail;
+	    *cvp = ncv;
+	    *maxcvp += 64;
+	}
+
+	if (col == 0)
+	{
+	    if (row > 0)
+		(*cvp)[col] = 0;
+	    else if (((*cvp)[col] = heap_add(tp, s, rc)) == TCELL_NONE)
+		goto Fail;
 	}
-	cv[col++] = cell;
-	
-	rc = csv_getsdup(&cell, cp);
+	else if (skip != TCELL_NONE && !TABLE_NEEDS(tp, col))
+	    (*cvp)[col] = skip;
+	else if (((*cvp)[col] = heap_intern(tp, s, rc)) == TCELL_NONE)
+	    goto Fail;
+	++col;
+
+	rc = csv_field(mp, &s);
     }
 
-    cv[col] = NULL;
-    
-    if (rc < 0 && rc != -2)
+    if (rc == -2)
+	return col;
+
+    tp->heaplen = start;
+    return 0;
+
+  Fail:
+    tp->heaplen = start;
+    return -1;
+}
+
+
+/*
+** Like sscanf(s, "%lf"), which unlike strtod() rejects a "0x" that
+** does not start a hexadecimal number.
+*/
+static int
+parse_dbl(const char *s,
+	  double *dp,
+	  char **epp)
+{
+    const char *p = s;
+    char *ep;
+
+
+    *dp = strtod(s, &ep);
+    *epp = ep;
+    if (ep == s)
+	return 0;
+
+    while (isspace((unsigned char) *p))
+	++p;
+    if (*p == '+' || *p == '-')
+	++p;
+
+    if (ep == p+1 && *p == '0' && (*ep == 'x' || *ep == 'X') && ep[1] != '.')
+	return 0;
+
+    return 1;
+}
+
+/* Grow the value arrays of a column from rows [0, from) to all rows */
+static int
+grow_keys(TCOLUMN *tcp,
+	  int from,
+	  int nrows)
+{
+    unsigned char *nflags;
+    int *nival;
+    double *ndval;
+
+
+    nflags = realloc(tcp->flags, nrows + 1);
+    if (nflags)
+	tcp->flags = nflags;
+    nival = realloc(tcp->ival, (nrows + 1) * sizeof(int));
+    if (nival)
+	tcp->ival = nival;
+    ndval = realloc(tcp->dval, (nrows + 1) * sizeof(double));
+    if (ndval)
+	tcp->dval = ndval;
+    if (!nflags || !nival || !ndval)
+	return -1;
+
+    memset(tcp->flags + from, 0, nrows + 1 - from);
+    memset(tcp->ival + from, 0, (nrows + 1 - from) * sizeof(int));
+    memset(tcp->dval + from, 0, (nrows + 1 - from) * sizeof(double));
+    return 0;
+}
+
+/* What the cells of a column seen so far allow its type to be */
+typedef struct
+{
+    char seen;
+    char ints;
+    char dbls;
+    char dates;
+} TKEYS;
+
+/*
+** A part of the work of a load, for a thread of its own: a chunk
+** of the file to parse, or rows to parse the values of.
+*/
+typedef struct
+{
+    TABLE *tp;
+    CSVMAP map;			/* The chunk */
+    TABLE part;			/* Its rows */
+    int row;			/* Number of its first row */
+    int first;			/* Index of that row in tp */
+    size_t base;		/* Offset of its heap in that of tp */
+    size_t end;			/* Bytes of the file its rows end at */
+    int r0, r1;			/* Rows to parse the values of */
+    TKEYS *keys;		/* Per column */
+    int rc;
+} TLJOB;
+
+
+/* Parse the values of the cells of column c in rows [r0, r1) */
+static void
+keys_rows(TABLE *tp,
+	  int c,
+	  int r0,
+	  int r1,
+	  TKEYS *kp)
+{
+    TCOLUMN *tcp = &tp->col[c];
+    const char *s;
+    char *ep, *dep;
+    unsigned int y, m, d;
+    long lv;
+    int r;
+
+
+    if (c == 0)
     {
-	if (cv)
-	    free(cv);
-	return NULL;
+	/* Row numbers, which are not stored as strings */
+	for (r = r0; r < r1; ++r)
+	{
+	    tcp->flags[r] = TCELL_INT | TCELL_DBL;
+	    tcp->ival[r] = r + 1;
+	    tcp->dval[r] = r + 1;
+	}
+	if (r0 < r1)
+	    kp->seen = 1;
+	kp->dates = 0;
+	return;
     }
-    
-    return cv;
+
+    for (r = r0; r < r1; ++r)
+    {
+	if (tcp->off[r] == TCELL_NONE)
+	    continue;
+	s = tp->heap + tcp->off[r];
+
+	if (parse_dbl(s, &tcp->dval[r], &dep))
+	    tcp->flags[r] |= TCELL_DBL;
+
+	lv = strtol(s, &ep, 10);
+	if (ep != s)
+	{
+	    tcp->flags[r] |= TCELL_INT;
+	    tcp->ival[r] = (int) lv;
+	}
+
+	if (!*s)
+	    continue;
+	kp->seen = 1;
+
+	if (kp->ints && (ep == s || *ep))
+	    kp->ints = 0;
+	if (kp->dbls && (!(tcp->flags[r] & TCELL_DBL) || *dep))
+	    kp->dbls = 0;
+	if (kp->dates && sscanf(s, "%u-%u-%u", &y, &m, &d) != 3)
+	    kp->dates = 0;
+    }
+}
+
+static void *
+keys_job(void *vp)
+{
+    TLJOB *jp = vp;
+    int c;
+
+
+    for (c = 0; c < jp->tp->cols; ++c)
+    {
+	jp->keys[c].seen = 0;
+	jp->keys[c].ints = jp->keys[c].dbls = jp->keys[c].dates = 1;
+	if (jp->tp->col[c].type != TCOL_NONE)
+	    keys_rows(jp->tp, c, jp->r0, jp->r1, &jp->keys[c]);
+    }
+
+    return NULL;
+}
+
+/*
+** Run the jobs in threads of their own, or here if that fails.
+*/
+static void
+tl_run(TLJOB *jv,
+       int nj,
+       void *(*fun)(void *))
+{
+    pthread_t tid[TLOAD_MAX_THREADS];
+    int started[TLOAD_MAX_THREADS];
+    int i;
+
+
+    for (i = 1; i < nj; ++i)
+	started[i] = (pthread_create(&tid[i], NULL, fun, &jv[i]) == 0);
+
+    fun(&jv[0]);
+
+    for (i = 1; i < nj; ++i)
+	if (started[i])
+	    pthread_join(tid[i], NULL);
+	else
+	    fun(&jv[i]);
+}
+
+/* The number of threads to split n units of work, at least min each, on */
+static int
+tl_threads(size_t n,
+	   size_t min)
+{
+    long ncpu;
+    int nt;
+
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (nt = 1; nt < ncpu && nt < TLOAD_MAX_THREADS && n / (nt + 1) >= min; ++nt)
+	;
+
+    return nt;
+}
+
+/*
+** Parse the numeric value of every cell from row from on once and
+** infer the column types, on top of those of the rows before. Empty
+** cells do not count against a type. Large tables are parsed by
+** several threads, each taking a range of rows.
+*/
+static int
+table_keys(TABLE *tp,
+	   int from)
+{
+    TCOLUMN *tcp;
+    TLJOB jv[TLOAD_MAX_THREADS];
+    TKEYS *kv;
+    int c, r, j, nj, seen;
+
+
+    kv = calloc((TLOAD_MAX_THREADS + 1) * (tp->cols + 1), sizeof(TKEYS));
+    if (!kv)
+	return -1;
+
+    for (c = 0; c < tp->cols; ++c)
+    {
+	tcp = &tp->col[c];
+
+	/* Columns the earlier rows do not have start out untyped */
+	if (!tcp->flags || from == 0)
+	{
+	    free(tcp->flags);
+	    free(tcp->ival);
+	    free(tcp->dval);
+	    tcp->flags = NULL;
+	    tcp->ival = NULL;
+	    tcp->dval = NULL;
+	    tcp->type = TCOL_STR;
+	}
+	if (grow_keys(tcp, tcp->flags ? from : 0, tp->nrows) < 0)
+	{
+	    free(kv);
+	    return -1;
+	}
+
+	if (!TABLE_NEEDS(tp, c))
+	    tcp->type = TCOL_NONE;
+    }
+
+    nj = tl_threads(tp->nrows - from, TLOAD_ROWS_MIN);
+    for (j = 0; j < nj; ++j)
+    {
+	jv[j].tp = tp;
+	jv[j].r0 = from + (long long) (tp->nrows - from) * j / nj;
+	jv[j].r1 = from + (long long) (tp->nrows - from) * (j+1) / nj;
+	jv[j].keys = kv + (j+1) * (tp->cols + 1);
+    }
+    tl_run(jv, nj, keys_job);
+
+    for (c = 0; c < tp->cols; ++c)
+    {
+	tcp = &tp->col[c];
+	if (tcp->type == TCOL_NONE)
+	    continue;
+
+	/* What the type of the earlier rows says about their cells */
+	seen = 0;
+	switch (from ? tcp->type : TCOL_STR)
+	{
+	  case TCOL_INT:
+	    kv[c].seen = 1;
+	    kv[c].ints = kv[c].dbls = 1;
+	    break;
+
+	  case TCOL_DBL:
+	    kv[c].seen = kv[c].dbls = 1;
+	    break;
+
+	  case TCOL_DATE:
+	    kv[c].seen = kv[c].dates = 1;
+	    break;
+
+	  default:
+	    for (r = 0; r < from && !seen; ++r)
+		seen = (tcp->off[r] != TCELL_NONE && tp->heap[tcp->off[r]]);
+	    kv[c].seen = seen;
+	    kv[c].ints = kv[c].dbls = kv[c].dates = !seen;
+	    break;
+	}
+
+	for (j = 0; j < nj; ++j)
+	{
+	    kv[c].seen |= jv[j].keys[c].seen;
+	    kv[c].ints &= jv[j].keys[c].ints;
+	    kv[c].dbls &= jv[j].keys[c].dbls;
+	    kv[c].dates &= jv[j].keys[c].dates;
+	}
+
+	if (!kv[c].seen)
+	    tcp->type = TCOL_STR;
+	else if (kv[c].ints)
+	    tcp->type = TCOL_INT;
+	else if (kv[c].dbls)
+	    tcp->type = TCOL_DBL;
+	else if (kv[c].dates)
+	    tcp->type = TCOL_DATE;
+	else
+	    tcp->type = TCOL_STR;
+    }
+
+    free(kv);
+    return 0;
+}
+
+/*
+** Have table_load() parse column col. Once a column has been asked
+** for, the columns that have not been are skipped (but for cell 0,
+** the row number), and read as empty strings.
+*/
+int
+table_project(TABLE *tp,
+	      int col)
+{
+    unsigned char *nneed;
+
+
+    if (col < 0)
+	return -1;
+
+    if (col >= tp->nneed)
+    {
+	nneed = realloc(tp->need, col + 16);
+	if (!nneed)
+	    return -1;
+	memset(nneed + tp->nneed, 0, col + 16 - tp->nneed);
+	tp->need = nneed;
+	tp->nneed = col + 16;
+    }
+
+    tp->need[col] = 1;
+    return 0;
+}
+
+/* Remember the file an empty table was loaded from, as stat()ed */
+static void
+table_source(TABLE *tp,
+	     const char *path,
+	     int header,
+	     const struct stat *sp)
+{
+    tp->path = strdup(path);
+    tp->header = header;
+    tp->st = *sp;
+}
+
+/* Show all rows, in the order they were loaded */
+static int
+table_view(TABLE *tp)
+{
+    int *nrow;
+
+
+    nrow = realloc(tp->row, (tp->nrows + 1) * sizeof(int));
+    if (!nrow)
+	return -1;
+    tp->row = nrow;
+    for (tp->rows = 0; tp->rows < tp->nrows; ++tp->rows)
+	tp->row[tp->rows] = tp->rows;
+
+    return tp->rows;
+}
+
+/*
+** Read the rows of a file into the table, numbered from row on, and
+** set *endp to the offset the last one ends at. Returns the number
+** of rows, or -1 on errors.
+*/
+static int
+load_rows(TABLE *tp,
+	  CSVMAP *mp,
+	  int row,
+	  unsigned int skip,
+	  size_t *endp)
+{
+    unsigned int *cv = NULL;
+    int maxcv = 0;
+    int c, n, nrows = 0;
+
+
+    while ((n = getrow(tp, mp, row++, skip, &cv, &maxcv)) > 0)
+    {
+	if (tp->nrows >= tp->maxrows && grow_rows(tp) < 0)
+	    goto Fail;
+
+	while (tp->cols < n)
+	    if (add_col(tp) < 0)
+		goto Fail;
+
+	for (c = 0; c < n; ++c)
+	    tp->col[c].off[tp->nrows] = cv[c];
+	tp->len[tp->nrows++] = n;
+	*endp = mp->pos;
+	++nrows;
+    }
+
+    free(cv);
+    return nrows;
+
+  Fail:
+    free(cv);
+    return -1;
+}
+
+static void *
+count_job(void *vp)
+{
+    TLJOB *jp = vp;
+
+    jp->rc = csv_lines(jp->map.buf, jp->map.len);
+    return NULL;
+}
+
+static void *
+parse_job(void *vp)
+{
+    TLJOB *jp = vp;
+    unsigned int skip = TCELL_NONE;
+
+
+    jp->part.need = jp->tp->need;
+    jp->part.nneed = jp->tp->nneed;
+
+    jp->rc = -1;
+    if (jp->part.need && (skip = heap_add(&jp->part, "", 0)) == TCELL_NONE)
+	return NULL;
+    jp->rc = load_rows(&jp->part, &jp->map, jp->row, skip, &jp->end);
+    return NULL;
+}
+
+/* Move the rows of a chunk into their place in the table */
+static void *
+join_job(void *vp)
+{
+    TLJOB *jp = vp;
+    TABLE *pp = &jp->part;
+    unsigned int off;
+    int c, r;
+
+
+    if (pp->heaplen)
+	memcpy(jp->tp->heap + jp->base, pp->heap, pp->heaplen);
+    memcpy(jp->tp->len + jp->first, pp->len, pp->nrows * sizeof(int));
+
+    for (c = 0; c < pp->cols; ++c)
+	for (r = 0; r < pp->nrows; ++r)
+	{
+	    off = pp->col[c].off[r];
+	    jp->tp->col[c].off[jp->first + r] = (off == TCELL_NONE) ? off : off + jp->base;
+	}
+
+    pp->need = NULL;
+    for (c = 0; c < pp->cols; ++c)
+	free(pp->col[c].off);
+    free(pp->col);
+    free(pp->len);
+    free(pp->heap);
+    free(pp->itab);
+    return NULL;
+}
+
+/*
+** Read the rows of a large file into an empty table in chunks, split
+** at line ends, that threads parse into tables of their own and that
+** are then joined in order. The rows of every chunk are counted first,
+** so that it knows the number of its first row. Returns the number of
+** rows, -1 on errors, or -2 if the file is not worth splitting.
+*/
+static int
+load_chunks(TABLE *tp,
+	    CSVMAP *mp,
+	    int row,
+	    size_t *endp)
+{
+    TLJOB jv[TLOAD_MAX_THREADS];
+    size_t start, split, len = mp->len - mp->pos, heaplen;
+    int j, nj, c, nrows, rc = -1;
+
+
+    nj = tl_threads(len, TLOAD_CHUNK_MIN);
+    if (nj < 2 || tp->nrows > 0)
+	return -2;
+
+    memset(jv, 0, sizeof(jv));
+    for (start = mp->pos, j = 0; j < nj; ++j)
+    {
+	jv[j].tp = tp;
+	jv[j].map.buf = mp->buf + start;
+	jv[j].map.fd = -1;
+	split = mp->pos + len / nj * (j+1);
+	jv[j].map.len = (j == nj-1) ? mp->len - start :
+	    csv_split(mp->buf, mp->len, start, split > start ? split : start) - start;
+	start += jv[j].map.len;
+    }
+
+    tl_run(jv, nj, count_job);
+    for (j = 0; j < nj; ++j)
+    {
+	jv[j].row = row;
+	row += jv[j].rc;
+    }
+
+    tl_run(jv, nj, parse_job);
+
+    heaplen = tp->heaplen;
+    for (nrows = 0, j = 0; j < nj; ++j)
+    {
+	if (jv[j].rc < 0)
+	    goto End;
+
+	jv[j].first = nrows;
+	jv[j].base = heaplen;
+	nrows += jv[j].part.nrows;
+	heaplen += jv[j].part.heaplen;
+	if (jv[j].part.nrows > 0)
+	    *endp = (jv[j].map.buf - mp->buf) + jv[j].end;
+
+	while (tp->cols < jv[j].part.cols)
+	    if (add_col(tp) < 0)
+		goto End;
+    }
+
+    /* Room for all rows, and the heaps one after another */
+    if (heaplen >= TCELL_NONE)
+	goto End;
+    while (tp->maxrows < nrows)
+	if (grow_rows(tp) < 0)
+	    goto End;
+    if (heaplen > tp->heapsize)
+    {
+	char *nheap = realloc(tp->heap, heaplen);
+
+	if (!nheap)
+	    goto End;
+	tp->heap = nheap;
+	tp->heapsize = heaplen;
+    }
+
+    tl_run(jv, nj, join_job);
+    tp->nrows = nrows;
+    tp->heaplen = heaplen;
+    return nrows;
+
+  End:
+    for (j = 0; j < nj; ++j)
+    {
+	for (c = 0; c < jv[j].part.cols; ++c)
+	    free(jv[j].part.col[c].off);
+	free(jv[j].part.col);
+	free(jv[j].part.len);
+	free(jv[j].part.heap);
+    }
+    return rc;
+}
+
+/*
+** Load a CSV file into the table. An empty table is loaded from the
+** snapshot of the file when there is a current one, and otherwise
+** a snapshot is written after the file has been parsed.
+*/
+int
+table_load(TABLE *tp,
+	   const char *path,
+	   int header)
+{
+    CSVMAP *mp;
+    struct stat sb;
+    unsigned int *cv = NULL;
+    unsigned int skip = TCELL_NONE;
+    int maxcv = 0;
+    int fresh = (tp->nrows == 0 && !tp->heap);
+    int n, from;
+    int row = 0;
+    off_t off = -1;
+    size_t end = 0;
+
+
+    if (tp->map)
+	return -1;
+
+    free(tp->nums);
+    tp->nums = NULL;
+
+    if (fresh && stat(path, &sb) == 0)
+    {
+	if (tsnap_load(tp, path, header, &sb) == 0)
+	{
+	    table_source(tp, path, header, &sb);
+	    return table_view(tp);
+	}
+
+	/* Only parse the rows appended since the snapshot */
+	off = tsnap_resume(tp, path, header, &sb);
+    }
+
+    mp = csv_map(path);
+    if (!mp)
+	return -1;
+
+    from = tp->nrows;
+    if (off >= 0)
+    {
+	mp->pos = (off < (off_t) mp->len) ? off : mp->len;
+	end = mp->pos;
+	row = tp->nrows;
+    }
+    else if (header)
+    {
+	n = getrow(tp, mp, row, TCELL_NONE, &cv, &maxcv);
+	if (n > 0)
+	{
+	    free(tp->head);
+	    tp->head = malloc(n * sizeof(unsigned int));
+	    if (!tp->head)
+		goto Fail;
+	    memcpy(tp->head, cv, n * sizeof(unsigned int));
+	    tp->hcols = n;
+	    end = mp->pos;
+	}
+    }
+
+    ++row;
+
+    if (tp->need && (skip = heap_add(tp, "", 0)) == TCELL_NONE)
+	goto Fail;
+
+    n = -2;
+    if (tp->nrows == 0 && mp->mapped)
+	n = load_chunks(tp, mp, row, &end);
+    if (n == -2)
+	n = load_rows(tp, mp, row, skip, &end);
+
+    /* Later loads only intern their own strings */
+    free(tp->itab);
+    tp->itab = NULL;
+    tp->isize = tp->icount = 0;
+
+    if (n < 0)
+	goto Fail;
+
+    if (table_keys(tp, from) < 0 || table_view(tp) < 0)
+	goto Fail;
+
+    if (fresh && S_ISREG(mp->st.st_mode))
+    {
+	table_source(tp, path, header, &mp->st);
+	tsnap_save(tp, path, header, &mp->st, end);
+    }
+
+    free(cv);
+    csv_unmap(mp);
+    return tp->rows;
+
+  Fail:
+    free(cv);
+    csv_unmap(mp);
+    return -1;
+}
+
+/* A filter, and the buffer cells are folded in when it ignores case */
+typedef struct
+{
+    char *filter;
+    int field;
+    int icase;
+    char *buf;
+    size_t size;
+} TMATCH;
+
+static int
+match_init(TMATCH *mp,
+	   const char *filter,
+	   int field,
+	   int flags)
+{
+    memset(mp, 0, sizeof(*mp));
+    mp->field = field;
+    mp->icase = (flags & TFILTER_ICASE) != 0;
+
+    mp->filter = strdup(filter);
+    if (!mp->filter)
+	return -1;
+    if (mp->icase)
+	tgram_fold(mp->filter, mp->filter, strlen(mp->filter));
+    return 0;
+}
+
+static void
+match_free(TMATCH *mp)
+{
+    free(mp->filter);
+    free(mp->buf);
+}
+
+static int
+match_cell(TMATCH *mp,
+	   const char *s)
+{
+    size_t len;
+    char *nbuf;
+
+
+    if (!mp->icase)
+	return strstr(s, mp->filter) != NULL;
+
+    len = strlen(s);
+    if (len + 1 > mp->size)
+    {
+	nbuf = realloc(mp->buf, len + 1024);
+	if (!nbuf)
+	    return 0;
+	mp->buf = nbuf;
+	mp->size = len + 1024;
+    }
+    tgram_fold(mp->buf, s, len + 1);
+    return strstr(mp->buf, mp->filter) != NULL;
+}
+
+/*
+** A row matches if the field contains the filter string, or if any
+** cell does when no field is given. Rows without the field match.
+*/
+static int
+row_match(TABLE *tp,
+	  int r,
+	  TMATCH *mp)
+{
+    const char *s;
+    int c;
+
+
+    if (mp->field >= 0)
+    {
+	s = CELL(tp, r, mp->field);
+	return !s || match_cell(mp, s);
+    }
+
+    for (c = 0; c < tp->len[r]; c++)
+	if (match_cell(mp, CELL(tp, r, c)))
+	    return 1;
+
+    return 0;
+}
+
+/*
+** Drop the rows not matching the filter from the view, as
+** table_print_html() would skip them. With TFILTER_INDEX only the
+** rows the trigram index gives are checked.
+*/
+int
+table_filter(TABLE *tp,
+	     const char *filter,
+	     int field,
+	     int flags)
+{
+    TMATCH m;
+    unsigned char *cand = NULL;
+    int i, r, n;
+
+
+    if (!tp)
+	return -1;
+
+    if (match_init(&m, filter, field, flags) < 0)
+	return -1;
+
+    if ((flags & TFILTER_INDEX) && (cand = calloc(tp->nrows + 1, 1)) != NULL &&
+	tgram_candidates(tp, m.filter, field, m.icase, cand) < 0)
+    {
+	free(cand);
+	cand = NULL;
+    }
+
+    /* Rows without the field are no candidates, but match */
+    for (i = n = 0; i < tp->rows; ++i)
+    {
+	r = tp->row[i];
+	if (cand && !cand[r] && !(field >= 0 && field >= tp->len[r]))
+	    continue;
+	if (row_match(tp, r, &m))
+	    tp->row[n++] = r;
+    }
+    tp->rows = n;
+
+    free(cand);
+    match_free(&m);
+    return n;
+}
+
+/*
+** A row of cells, given as an array so that loaded tables and
+** streamed files print the same.
+*/
+static void
+html_head(FILE *fp,
+	  char **cv,
+	  int n,
+	  const char *width,
+	  int count,
+	  int cols)
+{
+    int c;
+
+
+    fprintf(fp, "<tr class=\"header\">\n");
+    if (count)
+    {
+	fprintf(fp, "<th nowrap class=\"header\" align=right>");
+	fprintf(fp, "<a href=\"?field=%u&amp;sort=1\">", 0);
+	fputs("#", fp);
+	fputs("</a>", fp);
+	fputs("</th>\n", fp);
+    }
+
+    for (c = 1; c < n && (!cols || c < cols); ++c)
+    {
+	fprintf(fp, "<th nowrap class=\"header\" align=left %s%s>",
+		(c == 1 && width) ? "width=" : "", (c == 1 && width) ? width : "");
+
+	fprintf(fp, "<a href=\"?field=%u&amp;sort=1\">", c);
+	html_puts(cv[c], fp);
+	fprintf(fp, "</a>");
+	fprintf(fp, "</th>\n");
+    }
+    fprintf(fp, "</tr>\n");
+}
+
+static void
+html_row(FILE *fp,
+	 char **cv,
+	 int n,
+	 const char *width,
+	 int count,
+	 int cols,
+	 int odd)
+{
+    int c, nc;
+
+
+    /* fputs("<tr bgcolor=\"#D8D8D8\">\n", fp); */
+    if (odd)
+	fputs("<tr class=\"odd\">\n", fp);
+    else
+	fputs("<tr class=\"even\">\n", fp);
+
+    nc = 0;
+    for (c = (count ? 0 : 1); c < n && (!cols || nc < cols); ++c)
+    {
+	fprintf(fp, "<td nowrap align=\"%s\" %s%s>",
+		(count && c == 0) ? "right" : "left",
+		(c == 0 && width) ? "width=" : "",
+		(c == 0 && width) ? width : "");
+	html_puts(cv[c], fp);
+	fprintf(fp, "</td>\n");
+	++nc;
+    }
+    fprintf(fp, "</tr>\n");
+}
+
+/* Length of the UTF-8 sequence at s, or 0 if it is not one */
+static int
+utf8_len(const unsigned char *s)
+{
+    int n, i;
+
+
+    if (s[0] < 0xC2 || s[0] > 0xF4)
+	return 0;
+
+    n = (s[0] < 0xE0) ? 2 : (s[0] < 0xF0) ? 3 : 4;
+    for (i = 1; i < n; ++i)
+	if ((s[i] & 0xC0) != 0x80)
+	    return 0;
+    return n;
+}
+
+/*
+** A JSON string. Bytes that are not UTF-8 are taken to be Latin-1,
+** as older CSV files are.
+*/
+static void
+json_puts(const char *str,
+	  FILE *fp)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    int c, n;
+
+
+    putc('"', fp);
+    while ((c = *s) != '\0')
+    {
+	if (c == '"' || c == '\\')
+	{
+	    putc('\\', fp);
+	    putc(c, fp);
+	}
+	else if (c < ' ')
+	    fprintf(fp, "\\u%04x", c);
+	else if (c < 0x80)
+	    putc(c, fp);
+	else if ((n = utf8_len(s)) > 0)
+	{
+	    fwrite(s, 1, n, fp);
+	    s += n;
+	    continue;
+	}
+	else
+	{
+	    putc(0xC0 | (c >> 6), fp);
+	    putc(0x80 | (c & 0x3F), fp);
+	}
+	++s;
+    }
+    putc('"', fp);
+}
+
+/* The cells html_row() would show, as a JSON array */
+static void
+json_cells(FILE *fp,
+	   char **cv,
+	   int n,
+	   int count,
+	   int cols,
+	   int head)
+{
+    int c, nc;
+
+
+    putc('[', fp);
+    nc = 0;
+    for (c = (count ? 0 : 1); c < n && (!cols || nc < cols); ++c)
+    {
+	if (nc++)
+	    putc(',', fp);
+	json_puts((head && c == 0) ? "#" : cv[c], fp);
+    }
+    putc(']', fp);
+}
+
+/*
+** A table being printed, as HTML or (with TPRINT_JSON) as an object
+** {"head":[...],"rows":[[...],...]}, where "head" is only there if
+** the header row is shown.
+*/
+typedef struct
+{
+    FILE *fp;
+    const char *width;
+    int count;
+    int cols;
+    int json;
+    int rows;			/* Printed so far, not counting the header */
+} TPRINT;
+
+static void
+tprint_start(TPRINT *pp,
+	     FILE *fp,
+	     const char *opts,
+	     const char *width,
+	     int count,
+	     int cols,
+	     int flags)
+{
+    pp->fp = fp;
+    pp->width = width;
+    pp->count = count;
+    pp->cols = cols;
+    pp->json = (flags & TPRINT_JSON) != 0;
+    pp->rows = 0;
+
+    if (pp->json)
+    {
+	putc('{', fp);
+	return;
+    }
+
+    fprintf(fp, "<table");
+    if (opts)
+	fputs(opts, fp);
+    fputs(">\n", fp);
+}
+
+static void
+tprint_head(TPRINT *pp,
+	    char **cv,
+	    int n)
+{
+    if (!pp->json)
+    {
+	html_head(pp->fp, cv, n, pp->width, pp->count, pp->cols);
+	return;
+    }
+
+    fputs("\"head\":", pp->fp);
+    json_cells(pp->fp, cv, n, pp->count, pp->cols, 1);
+    putc(',', pp->fp);
+}
+
+static void
+tprint_row(TPRINT *pp,
+	   char **cv,
+	   int n,
+	   int odd)
+{
+    if (!pp->json)
+	html_row(pp->fp, cv, n, pp->width, pp->count, pp->cols, odd);
+    else
+    {
+	fputs(pp->rows ? ",\n" : "\"rows\":[\n", pp->fp);
+	json_cells(pp->fp, cv, n, pp->count, pp->cols, 0);
+    }
+    ++pp->rows;
+}
+
+static void
+tprint_end(TPRINT *pp)
+{
+    if (!pp->json)
+	fprintf(pp->fp, "</table>\n");
+    else
+	fputs(pp->rows ? "\n]}\n" : "\"rows\":[]}\n", pp->fp);
+}
+
+int
+table_print_html(TABLE *tp,
+		 FILE *fp,
+		 const char *opts,
+		 const char *width,
+		 const char *filter,
+		 int field,
+		 int count,
+		 int striped,
+		 int rows,
+		 int cols,
+		 int skip_header,
+		 int flags)
+{
+    TMATCH m;
+    TPRINT pr;
+    char **cv;
+    int i, r, c, n = 0;
+
+
+    if (!tp)
+	return -1;
+
+    if (filter && match_init(&m, filter, field, 0) < 0)
+	return -1;
+
+    cv = malloc((tp->cols > tp->hcols ? tp->cols : tp->hcols) * sizeof(char *) + 1);
+    if (!cv)
+    {
+	if (filter)
+	    match_free(&m);
+	return -1;
+    }
+
+    tprint_start(&pr, fp, opts, width, count, cols, flags);
+
+    if (tp->head && !skip_header)
+    {
+	n = 1;
+
+	for (c = 0; c < tp->hcols; ++c)
+	    cv[c] = tp->heap + tp->head[c];
+	tprint_head(&pr, cv, tp->hcols);
+    }
+
+    for (i = 0; i < tp->rows && (!rows || n < rows); ++i)
+    {
+	r = tp->row[i];
+
+	if (filter && !row_match(tp, r, &m))
+	    continue;
+
+	for (c = 0; c < tp->len[r]; ++c)
+	    cv[c] = (char *) CELL(tp, r, c);
+	tprint_row(&pr, cv, tp->len[r], striped && (n & 1));
+	++n;
+    }
+    tprint_end(&pr);
+
+    free(cv);
+    if (filter)
+	match_free(&m);
+    return 0;
+}
+
+
+/*
+** Read the next row of a streamed file into buf, pointed to by the
+** cells in cv. Cells from hi on, but for the one of field, are read
+** as empty strings unless hi is 0. Returns the number of cells as
+** getrow() does.
+*/
+static int
+stream_row(CSVMAP *mp,
+	   int row,
+	   int hi,
+	   int field,
+	   char **bufp,
+	   size_t *sizep,
+	   char ***cvp,
+	   int *maxcvp)
+{
+    char num[32];
+    char *s = num, *nbuf, **ncv;
+    size_t len = 1, size;
+    int col = 0;
+    int rc, c;
+
+
+    rc = sprintf(num, "%u", row);
+
+    /* The empty string skipped cells get */
+    if (!*sizep && !(*bufp = malloc(*sizep = 4096)))
+	return -1;
+    **bufp = '\0';
+
+    while (rc >= 0)
+    {
+	if (col >= *maxcvp)
+	{
+	    ncv = realloc(*cvp, (*maxcvp + 64) * sizeof(char *));
+	    if (!ncv)
+		return -1;
+	    *cvp = ncv;
+	    *maxcvp += 64;
+	}
+
+	/* Offsets until the row is complete, as buf may move */
+	if (hi > 0 && col >= hi && col != field)
+	    (*cvp)[col++] = (char *) 0;
+	else
+	{
+	    if (len + rc + 1 > *sizep)
+	    {
+		size = *sizep;
+		while (size < len + rc + 1)
+		    size *= 2;
+		nbuf = realloc(*bufp, size);
+		if (!nbuf)
+		    return -1;
+		*bufp = nbuf;
+		*sizep = size;
+	    }
+
+	    (*cvp)[col++] = (char *) len;
+	    memcpy(*bufp + len, s, rc);
+	    (*bufp)[len + rc] = '\0';
+	    len += rc + 1;
+	}
+
+	rc = csv_field(mp, &s);
+    }
+
+    if (rc != -2)
+	return 0;
+
+    for (c = 0; c < col; ++c)
+	(*cvp)[c] = *bufp + (size_t) (*cvp)[c];
+    return col;
+}
+
+/* As row_match(), for a row of cells */
+static int
+cells_match(char **cv,
+	    int n,
+	    TMATCH *mp)
+{
+    int c;
+
+
+    if (mp->field >= 0)
+	return mp->field >= n || match_cell(mp, cv[mp->field]);
+
+    for (c = 0; c < n; c++)
+	if (match_cell(mp, cv[c]))
+	    return 1;
+
+    return 0;
+}
+
+/*
+** Print a CSV file as table_load() and table_print_html() would,
+** for tables that need no sorting or date filtering. Rows are read,
+** filtered and printed one at a time, and reading stops once the
+** rows limit is reached.
+*/
+int
+table_stream_html(const char *path,
+		  int header,
+		  FILE *fp,
+		  const char *opts,
+		  const char *width,
+		  const char *filter,
+		  int field,
+		  int count,
+		  int striped,
+		  int rows,
+		  int cols,
+		  int skip_header,
+		  int flags)
+{
+    TMATCH m;
+    TPRINT pr;
+    CSVMAP *mp;
+    char *buf = NULL, **cv = NULL;
+    size_t size = 0;
+    int maxcv = 0;
+    int row = 0, n = 0, len;
+    int hi = 0;
+
+
+    if (filter && match_init(&m, filter, field, flags) < 0)
+	return -1;
+
+    /* A file that cannot be read prints as an empty table */
+    mp = csv_map(path);
+
+    tprint_start(&pr, fp, opts, width, count, cols, flags);
+
+    if (mp && header)
+    {
+	len = stream_row(mp, row, 0, -1, &buf, &size, &cv, &maxcv);
+	if (len > 0 && !skip_header)
+	{
+	    n = 1;
+	    tprint_head(&pr, cv, len);
+	}
+    }
+
+    ++row;
+
+    /* Only the cells shown or filtered on are copied */
+    if (cols > 0 && !(filter && field < 0))
+	hi = cols + (count ? 0 : 1);
+
+    while (mp && (!rows || n < rows) &&
+	   (len = stream_row(mp, row++, hi, filter ? field : -1,
+			     &buf, &size, &cv, &maxcv)) > 0)
+    {
+	if (filter && !cells_match(cv, len, &m))
+	    continue;
+
+	tprint_row(&pr, cv, len, striped && (n & 1));
+	++n;
+    }
+    tprint_end(&pr);
+
+    free(cv);
+    free(buf);
+    if (filter)
+	match_free(&m);
+    if (mp)
+	csv_unmap(mp);
+    return 0;
+}
+
+
+
+/*
+** Order the view by the stored ascending permutation for the sort,
+** read backwards for descending ones, and keep at most k rows (all
+** if k < 0). The permutation is made and stored on first use.
+** Returns the number of rows, or -1 if there is no usable one.
+*/
+static int
+table_perm_sort(TABLE *tp,
+		int col,
+		int type,
+		int dir,
+		int k)
+{
+    unsigned char *in = NULL;
+    int *perm = NULL;
+    int i, r, n, rc;
+
+
+    if (!tp->path || tp->nrows < 1)
+	return -1;
+
+    /* A negative column has always meant the row number */
+    if (col < 0)
+	col = 0;
+
+    rc = tsnap_perm_load(tp, col, type, &perm);
+    if (rc < 0)
+    {
+	perm = malloc(tp->nrows * sizeof(int));
+	if (!perm)
+	    return -1;
+
+	rc = tsort_perm(tp, perm, col, type);
+	if (rc >= 0)
+	    tsnap_perm_save(tp, col, type, rc ? perm : NULL);
+    }
+
+    if (rc <= 0)
+    {
+	free(perm);
+	return -1;
+    }
+
+    /* Rows the view does not have are skipped */
+    if (tp->rows < tp->nrows)
+    {
+	in = calloc(tp->nrows, 1);
+	if (!in)
+	{
+	    free(perm);
+	    return -1;
+	}
+	for (i = 0; i < tp->rows; ++i)
+	    in[tp->row[i]] = 1;
+    }
+
+    if (k < 0 || k > tp->rows)
+	k = tp->rows;
+
+    for (i = n = 0; i < tp->nrows && n < k; ++i)
+    {
+	r = perm[dir < 0 ? tp->nrows-1-i : i];
+	if (!in || in[r])
+	    tp->row[n++] = r;
+    }
+    tp->rows = n;
+
+    free(in);
+    free(perm);
+    return n;
+}
+
+/*
+** Sort the view, ascending if dir > 0 and descending otherwise.
+*/
+int
+table_sort(TABLE *tp,
+	   int col,
+	   int type,
+	   int dir)
+{
+    if (type < 1 || type > 4)
+	return -1;
+
+    if (table_perm_sort(tp, col, type, dir, -1) >= 0)
+	return 0;
+
+    return tsort_rows(tp, tp->row, tp->rows, col, type, dir);
+}
+
+/*
+** Sort only as far as needed to know the first k rows, and cut
+** the view there.
+*/
+int
+table_sort_top(TABLE *tp,
+	       int col,
+	       int type,
+	       int dir,
+	       int k)
+{
+    int n;
+
+
+    if (type < 1 || type > 4)
+	return -1;
+
+    if (table_perm_sort(tp, col, type, dir, k < 0 ? 0 : k) >= 0)
+	return 0;
+
+    n = tsort_top(tp, tp->row, tp->rows, col, type, dir, k);
+    if (n < 0)
+	return -1;
+
+    tp->rows = n;
+    return 0;
+}
+
+
+/*
+** External sorting, for files larger than the memory a sort may
+** use. Rows are read as table_stream_html() does, packed into
+** records with their sort keys until the budget is used up, sorted
+** and spilled to a temporary file as a run. The runs are then k-way
+** merged into the HTML output. The order is that of table_sort(),
+** but where that has no total order: "auto" columns with both
+** numbers and strings are ordered numbers first, and NaN by its bits.
+** Strings sort on their collation key, kept after the cells, unless
+** the collation is the byte order.
+*/
+
+/* Key classes, in sort order */
+#define XS_MISSING	0
+#define XS_NOVALUE	1
+#define XS_VALUE	2
+#define XS_STRING	3
+
+typedef struct
+{
+    int dir;
+    int cls;
+    int row;
+    int n;			/* Cells */
+    int key;			/* Offset of the sort cell, for strings */
+    int pad;
+    uint64_t val;		/* Numeric key */
+    size_t len;			/* Bytes of cells that follow */
+} XSREC;
+
+#define XS_CELLS(xp)	((char *) ((xp) + 1))
+#define XS_SIZE(len)	((sizeof(XSREC) + (len) + 7) & ~(size_t) 7)
+
+typedef struct
+{
+    FILE *fp;
+    XSREC *rec;
+    size_t size;
+} XSRUN;
+
+
+static int
+xs_cmp(const XSREC *a,
+       const XSREC *b)
+{
+    int d;
+
+
+    if (a->cls != b->cls)
+	d = a->cls < b->cls ? -1 : 1;
+    else if (a->cls == XS_STRING)
+	d = strcmp(XS_CELLS(a) + a->key, XS_CELLS(b) + b->key);
+    else if (a->cls == XS_VALUE && a->val != b->val)
+	d = a->val < b->val ? -1 : 1;
+    else
+	d = 0;
+
+    if (!d)
+	d = a->row < b->row ? -1 : a->row > b->row;
+
+    return a->dir < 0 ? -d : d;
+}
+
+static int
+xs_qcmp(const void *a,
+	const void *b)
+{
+    return xs_cmp(*(XSREC * const *) a, *(XSREC * const *) b);
+}
+
+/* The class and key of the sort cell s (NULL if the row lacks it) */
+static void
+xs_key(XSREC *xp,
+       const char *s,
+       int type)
+{
+    char *ep;
+    double d;
+    long lv;
+    uint64_t u;
+
+
+    xp->val = 0;
+    if (!s)
+    {
+	xp->cls = XS_MISSING;
+	return;
+    }
+
+    switch (type)
+    {
+      case 2:
+	xp->cls = XS_STRING;
+	return;
+
+      case 3:
+	lv = strtol(s, &ep, 10);
+	xp->cls = (ep != s) ? XS_VALUE : XS_NOVALUE;
+	xp->val = (uint32_t) (int) lv ^ 0x80000000U;
+	return;
+
+      default:
+	if (!parse_dbl(s, &d, &ep))
+	{
+	    xp->cls = (type == 1) ? XS_STRING : XS_NOVALUE;
+	    return;
+	}
+	xp->cls = XS_VALUE;
+	d += 0.0;
+	memcpy(&u, &d, sizeof(u));
+	xp->val = (u & 0x8000000000000000ULL) ? ~u : (u | 0x8000000000000000ULL);
+	return;
+    }
+}
+
+/*
+** The collation key of s into the buffer *bufp of *sizep bytes,
+** growing it as needed. Returns the key, or NULL.
+*/
+static char *
+xs_collate(const char *s,
+	   char **bufp,
+	   size_t *sizep)
+{
+    char *nb;
+    size_t len;
+
+
+    while ((len = collate_xfrm(*bufp, s, *sizep)) >= *sizep)
+    {
+	nb = realloc(*bufp, len + 64);
+	if (!nb)
+	    return NULL;
+	*bufp = nb;
+	*sizep = len + 64;
+    }
+    return *bufp;
+}
+
+/* Sort the n records whose pointers are at v and write them to a new run */
+static FILE *
+xs_spill(XSREC **v,
+	 int n)
+{
+    FILE *fp;
+    int i;
+
+
+    qsort(v, n, sizeof(XSREC *), xs_qcmp);
+
+    fp = tmpfile();
+    if (!fp)
+	return NULL;
+
+    for (i = 0; i < n; ++i)
+	if (fwrite(v[i], XS_SIZE(v[i]->len), 1, fp) != 1)
+	{
+	    fclose(fp);
+	    return NULL;
+	}
+
+    if (fflush(fp) != 0 || fseek(fp, 0L, SEEK_SET) != 0)
+    {
+	fclose(fp);
+	return NULL;
+    }
+    return fp;
 }
 
-int
-table_load(TABLE *tp,
-	   const char *path,
-	   int header)
+/* Read the next record of a run, or return -1 at its end */
+static int
+xs_next(XSRUN *rp)
 {
-    CSV *cp;
-    char **cv, ***nrv;
-    int i;
-    int row = 0;
-    
-    
-    cp = csv_open(path, "r");
+    XSREC hdr, *nrec;
+    size_t size;
 
-    if (header)
-	tp->head = getrow(cp, row);
 
-    ++row;
-    
-    if (!tp->cell)
+    if (!rp->fp || fread(&hdr, sizeof(hdr), 1, rp->fp) != 1)
+	return -1;
+
+    size = XS_SIZE(hdr.len);
+    if (size > rp->size)
     {
-	tp->cell = calloc(sizeof(char **), tp->maxrows = 128);
-	tp->rows = 0;
+	nrec = realloc(rp->rec, size);
+	if (!nrec)
+	    return -1;
+	rp->rec = nrec;
+	rp->size = size;
     }
 
-    while ((cv = getrow(cp, row++)) != NULL)
+    *rp->rec = hdr;
+    if (fread(XS_CELLS(rp->rec), size - sizeof(hdr), 1, rp->fp) != 1)
+	return -1;
+    return 0;
+}
+
+/* Restore the heap order of the runs in hv[] below position i */
+static void
+xs_down(XSRUN **hv,
+	int n,
+	int i)
+{
+    XSRUN *t;
+    int c;
+
+
+    while ((c = 2*i + 1) < n)
     {
-	if (tp->rows+1 >= tp->maxrows)
-	{
-	    nrv = calloc(sizeof(char **), tp->maxrows += 128);
-	    if (!nrv)
-		return -1;
-	    
-	    for (i = 0; i < tp->rows; i++)
-		nrv[i] = tp->cell[i];
-	    free(tp->cell);
-	    tp->cell = nrv;
-	}
-	tp->cell[tp->rows++] = cv;
+	if (c+1 < n && xs_cmp(hv[c+1]->rec, hv[c]->rec) < 0)
+	    ++c;
+	if (xs_cmp(hv[i]->rec, hv[c]->rec) <= 0)
+	    break;
+	t = hv[i];
+	hv[i] = hv[c];
+	hv[c] = t;
+	i = c;
     }
-    tp->cell[tp->rows] = NULL;
-
-    csv_close(cp);
-    return tp->rows;
 }
 
+/*
+** Print a CSV file sorted as table_load(), table_filter(),
+** table_sort() and table_print_html() would, using about mem bytes
+** of memory however large the file is.
+*/
 int
-table_print_html(TABLE *tp,
+table_xsort_html(const char *path,
+		 int header,
 		 FILE *fp,
 		 const char *opts,
 		 const char *width,
@@ -164,323 +2008,422 @@ table_print_html(TABLE *tp,
 		 int striped,
 		 int rows,
 		 int cols,
-		 int skip_header)
+		 int skip_header,
+		 int flags,
+		 int type,
+		 int dir,
+		 size_t mem)
 {
-    int r, c, n = 0, nc;
+    TMATCH m;
+    TPRINT pr;
+    CSVMAP *mp;
+    XSRUN *rv = NULL, *nrv, **hv = NULL;
+    XSREC *xp, kr;
+    char *buf = NULL, **cv = NULL, *arena = NULL, *narena, *p;
+    char *kbuf = NULL, *ckey;
+    size_t size = 0, used = 0, asize, rsize, ksize = 0;
+    int maxcv = 0;
+    int row = 0, n = 0, nrec = 0, nrun = 0, nheap, c, len, col, hi = 0;
+    int rc = -1;
 
 
-    if (!tp)
+    if (type < 1 || type > 4)
 	return -1;
-    
-    fprintf(fp, "<table");
-    if (opts)
-	fputs(opts, fp);
-    fputs(">\n", fp);
-    
-    if (tp->head && !skip_header)
+
+    if (filter && match_init(&m, filter, field, flags) < 0)
+	return -1;
+
+    /* A negative column has always meant the row number */
+    col = (field < 0) ? 0 : field;
+
+    /* A file that cannot be read prints as an empty table */
+    mp = csv_stream(path);
+
+    tprint_start(&pr, fp, opts, width, count, cols, flags);
+
+    asize = (mem > 65536 ? mem : 65536) & ~(size_t) 7;
+    arena = malloc(asize);
+    if (!arena)
+	goto End;
+
+    if (mp && header && csv_fill(mp) == 0)
     {
-	n = 1;
-	
-	fprintf(fp, "<tr class=\"header\">\n");
-	if (count)
+	len = stream_row(mp, row, 0, -1, &buf, &size, &cv, &maxcv);
+	if (len > 0 && !skip_header)
 	{
-	    fprintf(fp, "<th nowrap class=\"header\" align=right>");
-	    fprintf(fp, "<a href=\"?field=%u&amp;sort=1\">", 0);
-	    fputs("#", fp);
-	    fputs("</a>", fp);
-	    fputs("</th>\n", fp);
+	    n = 1;
+	    tprint_head(&pr, cv, len);
 	}
-	    
-	for (c = 1; tp->head[c] && (!cols || c < cols); ++c)
-	{
-	    fprintf(fp, "<th nowrap class=\"header\" align=left %s%s>",
-		    (c == 1 && width) ? "width=" : "", (c == 1 && width) ? width : "");
-
-	    fprintf(fp, "<a href=\"?field=%u&amp;sort=1\">", c);
-	    html_puts(tp->head[c], fp);
-	    fprintf(fp, "</a>");
-	    fprintf(fp, "</th>\n");	    
-	}
-	fprintf(fp, "</tr>\n");
     }
-    
-    if (tp->cell)
+
+    ++row;
+
+    /* Only the cells shown, sorted or filtered on are kept */
+    if (cols > 0 && !(filter && field < 0))
+	hi = cols + (count ? 0 : 1);
+
+    for (;;)
     {
-	for (r = 0; r < tp->rows && tp->cell[r] && (!rows || n < rows); ++r)
-	{
-	    if (filter)
-	    {
-		if (field >= 0)
-		{
-		    int i;
-		    
-		    for (i = 0; field != i && tp->cell[r][i] != NULL; i++)
-			;
-		    if (tp->cell[r][i] && strstr(tp->cell[r][i], filter) == NULL)
-			continue;
-		}
-		else
-		{
-		    int i;
-		    
-		    for (i = 0; tp->cell[r][i] != NULL &&
-			     strstr(tp->cell[r][i], filter) == NULL; i++)
-			;
-		    if (!tp->cell[r][i])
-			continue;
-		}
-	    }
+	len = 0;
+	if (mp && csv_fill(mp) == 0)
+	    len = stream_row(mp, row++, hi, col,
+			     &buf, &size, &cv, &maxcv);
 
-	    /* fputs("<tr bgcolor=\"#D8D8D8\">\n", fp); */
-	    if (striped && (n & 1))
-		fputs("<tr class=\"odd\">\n", fp);
-	    else
-		fputs("<tr class=\"even\">\n", fp);
-	    ++n;
-	    
-#if 0
-	    if (count)
-	    {
-		fprintf(fp, "<td nowrap align=right>");
-		printf("<b>%u</b>", count++);
-		fprintf(fp, "</td>\n");	    
-	    }
-#endif
+	if (len > 0 && filter && !cells_match(cv, len, &m))
+	    continue;
 
-	    nc = 0;
-	    for (c = (count ? 0 : 1); tp->cell[r][c] && (!cols || nc < cols); ++c)
-	    {
-		fprintf(fp, "<td nowrap align=\"%s\" %s%s>",
-			(count && c == 0) ? "right" : "left",
-			(c == 0 && width) ? "width=" : "",
-			(c == 0 && width) ? width : "");
-		html_puts(tp->cell[r][c], fp);
-		fprintf(fp, "</td>\n");
-		++nc;
-	    }
-	    fprintf(fp, "</tr>\n");
+	rsize = 0;
+	ckey = NULL;
+	if (len > 0)
+	{
+	    xs_key(&kr, col < len ? cv[col] : NULL, type);
+	    if (kr.cls == XS_STRING && collate_id() &&
+		(ckey = xs_collate(cv[col], &kbuf, &ksize)) == NULL)
+		goto End;
+
+	    rsize = sizeof(XSREC);
+	    for (c = 0; c < len; ++c)
+		rsize += strlen(cv[c]) + 1;
+	    if (ckey)
+		rsize += strlen(ckey) + 1;
+	    rsize = XS_SIZE(rsize - sizeof(XSREC));
 	}
-    }
-    fprintf(fp, "</table>\n");
-    
-    return 0;
-}
 
+	/* Records grow up from the start, their pointers down from the end */
+	if (nrec > 0 && (len <= 0 || used + rsize + (nrec+1) * sizeof(XSREC *) > asize))
+	{
+	    nrv = realloc(rv, (nrun + 1) * sizeof(XSRUN));
+	    if (!nrv)
+		goto End;
+	    rv = nrv;
+	    memset(&rv[nrun], 0, sizeof(XSRUN));
+	    rv[nrun].fp = xs_spill((XSREC **) (arena + asize) - nrec, nrec);
+	    if (!rv[nrun++].fp)
+		goto End;
+	    used = 0;
+	    nrec = 0;
+	}
 
+	if (len <= 0)
+	    break;
 
-static int sort_col = 0;
-static int sort_dir = 1;
+	/* A row larger than the budget still has to fit */
+	if (rsize + sizeof(XSREC *) > asize)
+	{
+	    narena = realloc(arena, rsize + sizeof(XSREC *));
+	    if (!narena)
+		goto End;
+	    arena = narena;
+	    asize = rsize + sizeof(XSREC *);
+	}
 
+	xp = (XSREC *) (arena + used);
+	xp->dir = dir;
+	xp->row = row - 1;
+	xp->n = len;
+	xp->key = 0;
+	xp->pad = 0;
+	xp->cls = kr.cls;
+	xp->val = kr.val;
+
+	p = XS_CELLS(xp);
+	for (c = 0; c < len; ++c)
+	{
+	    if (c == col)
+		xp->key = p - XS_CELLS(xp);
+	    strcpy(p, cv[c]);
+	    p += strlen(p) + 1;
+	}
+	if (ckey)
+	{
+	    xp->key = p - XS_CELLS(xp);
+	    strcpy(p, ckey);
+	    p += strlen(p) + 1;
+	}
+	xp->len = p - XS_CELLS(xp);
 
-static const char *
-get_cell(const char **row,
-	 int col)
-{
-    int c;
+	used += rsize;
+	++nrec;
+	((XSREC **) (arena + asize))[-nrec] = xp;
+    }
 
-    
-    for (c = 0; row[c] != NULL && c < col; ++c)
-	;
+    /* The runs are read back with the sorting memory freed */
+    free(arena);
+    arena = NULL;
 
-    return row[c];
-}
+    hv = malloc((nrun + 1) * sizeof(XSRUN *));
+    if (!hv)
+	goto End;
 
-static int
-i_sort_auto(const void *e1,
-	    const void *e2,
-	    int sort_col)
-{
-    const char ***r1 = (const char ***) e1;
-    const char ***r2 = (const char ***) e2;
-    const char *c1, *c2;
-    int i1, i2;
-    double d1, d2;
+    for (c = nheap = 0; c < nrun; ++c)
+	if (xs_next(&rv[c]) == 0)
+	    hv[nheap++] = &rv[c];
+    for (c = nheap/2 - 1; c >= 0; --c)
+	xs_down(hv, nheap, c);
 
-    
-    c1 = get_cell(*r1, sort_col);
-    c2 = get_cell(*r2, sort_col);
+    while (nheap > 0 && (!rows || n < rows))
+    {
+	xp = hv[0]->rec;
+	if (xp->n > maxcv)
+	{
+	    free(cv);
+	    maxcv = xp->n;
+	    cv = malloc(maxcv * sizeof(char *));
+	    if (!cv)
+		goto End;
+	}
 
-    if (!c1 && !c2)
-	return 0;
+	p = XS_CELLS(xp);
+	for (c = 0; c < xp->n; ++c)
+	{
+	    cv[c] = p;
+	    p += strlen(p) + 1;
+	}
 
-    if (!c1)
-	return -1;
-    if (!c2)
-	return +1;
+	tprint_row(&pr, cv, xp->n, striped && (n & 1));
+	++n;
 
-    if (sscanf(c1, "%lf", &d1) == 1 &&
-	sscanf(c2, "%lf", &d2) == 1)
-    {
-	if (d1 - d2 < 0)
-	    return -1;
-	else if (d1 - d2 > 0)
-	    return +1;
-	else
-	    return 0;
+	if (xs_next(hv[0]) < 0)
+	    hv[0] = hv[--nheap];
+	xs_down(hv, nheap, 0);
     }
+    rc = 0;
 
-    if (sscanf(c1, "%d", &i1) == 1 &&
-	sscanf(c2, "%d", &i2) == 1)
-	return i1 - i2;
+  End:
+    tprint_end(&pr);
 
-    return strcmp(c1, c2);
+    for (c = 0; c < nrun; ++c)
+    {
+	if (rv[c].fp)
+	    fclose(rv[c].fp);
+	free(rv[c].rec);
+    }
+    free(rv);
+    free(hv);
+    free(arena);
+    free(cv);
+    free(buf);
+    free(kbuf);
+    if (filter)
+	match_free(&m);
+    if (mp)
+	csv_unmap(mp);
+    return rc;
 }
 
 
-static int
-sort_auto(const void *e1,
-	  const void *e2)
-{
-    int d;
-    
-    d = i_sort_auto(e1, e2, sort_col);
-    if (d)
-	return d * sort_dir;
-
-    if (sort_col != 0)
-	return i_sort_auto(e1, e2, 0) * sort_dir;
+/*
+** Merged tables, for several files of the same layout. Each table is
+** loaded, filtered and sorted on its own (with its snapshot and
+** stored sort), and the views are k-way merged into the output.
+*/
 
-    return 0;
-}
+/* A table being merged, at the row of its view that is next */
+typedef struct
+{
+    TABLE *tp;
+    int i;
+    int base;			/* Rows of the tables before it */
+    XSREC key;			/* Class and numeric key of the row */
+    const char *s;		/* Sort cell, or its collation key */
+    char *kbuf;
+    size_t ksize;
+    char num[16];		/* Row number in the merged table */
+} TMCUR;
 
 static int
-sort_str(const void *e1,
-	 const void *e2)
+tm_cmp(const TMCUR *a,
+       const TMCUR *b)
 {
-    const char ***r1 = (const char ***) e1;
-    const char ***r2 = (const char ***) e2;
-    const char *c1, *c2;
-    int d;
-    
-
-    c1 = get_cell(*r1, sort_col);
-    c2 = get_cell(*r2, sort_col);
+    int d, ra, rb;
 
-    if (!c1 && !c2)
-	return 0;
 
-    if (!c1)
-	return -1 * sort_dir;
-    if (!c2)
-	return +1 * sort_dir;
+    if (a->key.cls != b->key.cls)
+	d = a->key.cls < b->key.cls ? -1 : 1;
+    else if (a->key.cls == XS_STRING)
+	d = strcmp(a->s, b->s);
+    else if (a->key.cls == XS_VALUE && a->key.val != b->key.val)
+	d = a->key.val < b->key.val ? -1 : 1;
+    else
+	d = 0;
 
-    d = strcmp(c1, c2);
-    if (d)
-	return d * sort_dir;
+    if (!d)
+    {
+	ra = a->base + a->tp->row[a->i];
+	rb = b->base + b->tp->row[b->i];
+	d = ra < rb ? -1 : ra > rb;
+    }
 
-    if (sort_col != 0)
-	return i_sort_auto(e1, e2, 0) * sort_dir;
-    return 0;
+    return a->key.dir < 0 ? -d : d;
 }
 
+/* Move to the next row of the view, or return -1 at its end */
 static int
-sort_int(const void *e1,
-	 const void *e2)
+tm_next(TMCUR *mp,
+	int col,
+	int type,
+	int dir)
 {
-    const char ***r1 = (const char ***) e1;
-    const char ***r2 = (const char ***) e2;
-    const char *c1, *c2;
-    int v1, v2, d;
+    const char *k;
+    int r;
 
-    
-    c1 = get_cell(*r1, sort_col);
-    c2 = get_cell(*r2, sort_col);
 
-    if (!c1 && !c2)
-	return 0;
+    if (++mp->i >= mp->tp->rows)
+	return -1;
 
-    if (!c1)
-	return -1 * sort_dir;
-    if (!c2)
-	return +1 * sort_dir;
+    r = mp->tp->row[mp->i];
+    sprintf(mp->num, "%d", mp->base + r + 1);
+    mp->s = (col == 0) ? mp->num : CELL(mp->tp, r, col);
+    mp->key.dir = dir;
+    xs_key(&mp->key, mp->s, type);
 
-    if (sscanf(c1, "%d", &v1) != 1)
-	return -1 * sort_dir;
-    
-    if (sscanf(c2, "%d", &v2) != 1)
-	return +1 * sort_dir;
+    if (mp->key.cls == XS_STRING && collate_id() &&
+	(k = xs_collate(mp->s, &mp->kbuf, &mp->ksize)) != NULL)
+	mp->s = k;
+    return 0;
+}
+
+static void
+tm_down(TMCUR **hv,
+	int n,
+	int i)
+{
+    TMCUR *t;
+    int c;
 
-    d = v1 - v2;
-    if (d)
-	return d * sort_dir;
 
-    if (sort_col != 0)
-	return i_sort_auto(e1, e2, 0) * sort_dir;
-    else
-	return 0;
+    while ((c = 2*i + 1) < n)
+    {
+	if (c+1 < n && tm_cmp(hv[c+1], hv[c]) < 0)
+	    ++c;
+	if (tm_cmp(hv[i], hv[c]) <= 0)
+	    break;
+	t = hv[i];
+	hv[i] = hv[c];
+	hv[c] = t;
+	i = c;
+    }
 }
 
-static int
-sort_dbl(const void *e1,
-	 const void *e2)
+/*
+** Print the n tables in tv[], each already filtered and sorted on
+** field as table_sort() does (type 1-4), as if their files were one:
+** the header of the first table, then the rows of all of them in
+** sort order, or file by file for other types, with the row numbers
+** running on from one file to the next. As for table_xsort_html(),
+** "auto" columns with both numbers and strings put numbers first.
+** The filter, if any, is matched against the rows as printed, so
+** with their row numbers in the whole.
+*/
+int
+table_merge_html(TABLE **tv,
+		 int n,
+		 FILE *fp,
+		 const char *opts,
+		 const char *width,
+		 const char *filter,
+		 int field,
+		 int count,
+		 int striped,
+		 int rows,
+		 int cols,
+		 int skip_header,
+		 int flags,
+		 int type,
+		 int dir)
 {
-    const char ***r1 = (const char ***) e1;
-    const char ***r2 = (const char ***) e2;
-    const char *c1, *c2;
-    double d1, d2, d;
+    TMATCH m;
+    TPRINT pr;
+    TMCUR *mv, **hv;
+    TABLE *tp;
+    char **cv;
+    int i, r, c, nheap, maxc = 1, base = 0, k = 0;
+    int col = (field < 0) ? 0 : field;
 
-    
-    c1 = get_cell(*r1, sort_col);
-    c2 = get_cell(*r2, sort_col);
 
-    if (!c1 && !c2)
-	return 0;
+    for (i = 0; i < n; ++i)
+    {
+	if (tv[i]->cols > maxc)
+	    maxc = tv[i]->cols;
+	if (tv[i]->hcols > maxc)
+	    maxc = tv[i]->hcols;
+    }
 
-    if (!c1)
-	return -1 * sort_dir;
-    if (!c2)
-	return +1 * sort_dir;
+    mv = calloc(n + 1, sizeof(TMCUR));
+    hv = malloc((n + 1) * sizeof(TMCUR *));
+    cv = malloc(maxc * sizeof(char *));
+    if (!mv || !hv || !cv || (filter && match_init(&m, filter, field, flags) < 0))
+    {
+	free(mv);
+	free(hv);
+	free(cv);
+	return -1;
+    }
 
-    if (sscanf(c1, "%lf", &d1) != 1)
-	return -1 * sort_dir;
-    
-    if (sscanf(c2, "%lf", &d2) != 1)
-	return +1 * sort_dir;
+    tprint_start(&pr, fp, opts, width, count, cols, flags);
 
-    d = d1 - d2;
-    if (d < 0)
-	return -1 * sort_dir;
+    if (n > 0 && tv[0]->head && !skip_header)
+    {
+	k = 1;
 
-    if (d > 0)
-	return +1 * sort_dir;
+	tp = tv[0];
+	for (c = 0; c < tp->hcols; ++c)
+	    cv[c] = tp->heap + tp->head[c];
+	tprint_head(&pr, cv, tp->hcols);
+    }
 
-    if (sort_col != 0)
-	return i_sort_auto(e1, e2, 0) * sort_dir;
-    else
-	return 0;
-}
+    for (i = nheap = 0; i < n; ++i)
+    {
+	mv[i].tp = tv[i];
+	mv[i].i = -1;
+	mv[i].base = base;
+	base += tv[i]->nrows;
 
-	 
-int
-table_sort(TABLE *tp,
-	   int col,
-	   int type)
-{
-    sort_col = col;
-    sort_dir = (type < 0 ? -1 : 1);
-    
-    switch (type)
+	if (tm_next(&mv[i], col, type, dir) == 0)
+	    hv[nheap++] = &mv[i];
+    }
+
+    /* Other sort types keep the files in order */
+    if (type >= 1 && type <= 4)
+	for (i = nheap/2 - 1; i >= 0; --i)
+	    tm_down(hv, nheap, i);
+
+    while (nheap > 0 && (!rows || k < rows))
     {
-      case 1:
-	qsort(&tp->cell[0], tp->rows, sizeof(tp->cell[0]), sort_auto);
-	break;
-	
-      case 2:
-	qsort(&tp->cell[0], tp->rows, sizeof(tp->cell[0]), sort_str);
-	break;
-	
-      case 3:
-	qsort(&tp->cell[0], tp->rows, sizeof(tp->cell[0]), sort_int);
-	break;
+	tp = hv[0]->tp;
+	r = tp->row[hv[0]->i];
 
-      case 4:
-	qsort(&tp->cell[0], tp->rows, sizeof(tp->cell[0]), sort_dbl);
-	break;
+	cv[0] = hv[0]->num;
+	for (c = 1; c < tp->len[r]; ++c)
+	    cv[c] = (char *) CELL(tp, r, c);
+	if (!filter || cells_match(cv, tp->len[r], &m))
+	{
+	    tprint_row(&pr, cv, tp->len[r], striped && (k & 1));
+	    ++k;
+	}
 
-      default:
-	return -1;
+	if (tm_next(hv[0], col, type, dir) < 0)
+	{
+	    if (type >= 1 && type <= 4)
+		hv[0] = hv[--nheap];
+	    else
+	    {
+		memmove(hv, hv + 1, --nheap * sizeof(TMCUR *));
+		continue;
+	    }
+	}
+	if (type >= 1 && type <= 4)
+	    tm_down(hv, nheap, 0);
     }
-
+    tprint_end(&pr);
+
+    if (filter)
+	match_free(&m);
+    for (i = 0; i < n; ++i)
+	free(mv[i].kbuf);
+    free(mv);
+    free(hv);
+    free(cv);
     return 0;
 }
 
@@ -549,43 +2492,202 @@ str2time2(const char *str,
 }
 
 
+
+/*
+** Date index of a column: the start and stop times of every row
+** (as str2time2() gives them) and the rows that have the cell,
+** ordered by stop time and then row.
+*/
+typedef struct
+{
+    int32_t n;
+    int32_t pad;
+} TDATEHDR;
+
+#define TDATE_START(hp)		((int64_t *) ((hp) + 1))
+#define TDATE_STOP(hp,nrows)	(TDATE_START(hp) + (nrows))
+#define TDATE_ROW(hp,nrows)	((int32_t *) (TDATE_STOP(hp, nrows) + (nrows)))
+
+typedef struct
+{
+    int64_t stop;
+    int32_t row;
+} TDATEKEY;
+
+static int
+date_cmp(const void *a,
+	 const void *b)
+{
+    const TDATEKEY *k1 = a, *k2 = b;
+
+
+    if (k1->stop != k2->stop)
+	return k1->stop < k2->stop ? -1 : 1;
+    return k1->row - k2->row;
+}
+
+/* The time zone that mktime() works in, as a key for stored indexes */
+static unsigned int
+date_tz(void)
+{
+    const char *s;
+    unsigned int h = 2166136261U;
+
+
+    tzset();
+    for (s = getenv("TZ"); s && *s; ++s)
+	h = (h ^ (unsigned char) *s) * 16777619U;
+    return (h ^ (unsigned int) timezone) | 1;
+}
+
+/*
+** Get the date index of column col, making and storing it on first
+** use. Returns it malloc()ed, or NULL.
+*/
+static TDATEHDR *
+date_index(TABLE *tp,
+	   int col)
+{
+    TDATEHDR *hp;
+    TDATEKEY *kv;
+    void *data;
+    size_t len;
+    unsigned int tz = date_tz();
+    int nrows = tp->nrows;
+    int r, n;
+    const char *s;
+    time_t start, stop;
+
+
+    if (tsnap_side_load(tp, col, TSNAP_DATES, tz, &data, &len) == 1)
+    {
+	hp = data;
+	if (len >= sizeof(*hp) && hp->n >= 0 && hp->n <= nrows &&
+	    len == sizeof(*hp) + nrows * 2 * sizeof(int64_t) + hp->n * sizeof(int32_t))
+	    return hp;
+	free(data);
+    }
+
+    len = sizeof(*hp) + nrows * (2 * sizeof(int64_t) + sizeof(int32_t));
+    hp = malloc(len);
+    kv = malloc(nrows * sizeof(TDATEKEY) + 1);
+    if (!hp || !kv)
+    {
+	free(hp);
+	free(kv);
+	return NULL;
+    }
+
+    for (r = n = 0; r < nrows; ++r)
+    {
+	start = stop = (time_t) -1;
+	if ((s = CELL(tp, r, col)) != NULL)
+	{
+	    str2time2(s, &start, &stop);
+	    kv[n].stop = stop;
+	    kv[n++].row = r;
+	}
+	TDATE_START(hp)[r] = start;
+	TDATE_STOP(hp, nrows)[r] = stop;
+    }
+
+    qsort(kv, n, sizeof(TDATEKEY), date_cmp);
+    for (r = 0; r < n; ++r)
+	TDATE_ROW(hp, nrows)[r] = kv[r].row;
+    free(kv);
+
+    hp->n = n;
+    hp->pad = 0;
+    len = sizeof(*hp) + nrows * 2 * sizeof(int64_t) + n * sizeof(int32_t);
+    tsnap_side_save(tp, col, TSNAP_DATES, tz, hp, len);
+
+    return hp;
+}
+
+/*
+** Drop the rows whose date in date_field has passed at now, or that
+** start more than date_range days after it. Rows without the field
+** are kept. Only the rows that have not ended yet are looked at,
+** found by a binary search of the date index. If untilp is not NULL,
+** *untilp is set to the first time after now that would keep other
+** rows, or to 0 if there is none.
+*/
 int
 table_date_filter(TABLE *tp,
 		  int date_field,
-		  int date_range)
+		  int date_range,
+		  time_t now,
+		  time_t *untilp)
 {
-    int r, c, i;
-    time_t now;
-    time_t start, stop;
-    
+    TDATEHDR *hp;
+    int64_t *start, *stop;
+    int32_t *drow;
+    unsigned char *keep;
+    time_t until = 0, t;
+    int i, r, n, lo, hi;
+
 
     if (!tp)
 	return -1;
-    
-    time(&now);
-    for (r = 0; tp->cell[r]; ++r)
+
+    if (date_field < 0)
+	return tp->rows;
+
+    hp = date_index(tp, date_field);
+    if (!hp)
+	return -1;
+
+    keep = calloc(tp->nrows + 1, 1);
+    if (!keep)
     {
-	for (c = 0; tp->cell[r][c] && c < date_field; ++c)
-	    ;
+	free(hp);
+	return -1;
+    }
 
-	if (c != date_field || !tp->cell[r][c])
-	    continue;
+    start = TDATE_START(hp);
+    stop = TDATE_STOP(hp, tp->nrows);
+    drow = TDATE_ROW(hp, tp->nrows);
+
+    /* The first row that has not ended */
+    lo = 0;
+    hi = hp->n;
+    while (lo < hi)
+    {
+	i = lo + (hi - lo) / 2;
+	if (stop[drow[i]] < now)
+	    lo = i + 1;
+	else
+	    hi = i;
+    }
 
-	str2time2(tp->cell[r][c], &start, &stop);
+    /* Then the first row to end is dropped */
+    if (lo < hp->n)
+	until = stop[drow[lo]] + 1;
 
-	if (stop < now ||
-	    (date_range && start != (time_t) -1 &&
-	     (start > now+date_range*24*60*60)))
-	{
-	    for (i = r; tp->cell[i+1]; ++i)
-		tp->cell[i] = tp->cell[i+1];
-	    tp->cell[i] = NULL;
-	    --r;
-	    tp->rows--;
-	}
+    for (i = lo; i < hp->n; ++i)
+    {
+	r = drow[i];
+	if (!(date_range && start[r] != (time_t) -1 &&
+	      (start[r] > now+date_range*24*60*60)))
+	    keep[r] = 1;
+	else if ((t = start[r] - date_range*24*60*60) < until)
+	    until = t;
+    }
+
+    if (untilp)
+	*untilp = until;
+
+    for (i = n = 0; i < tp->rows; ++i)
+    {
+	r = tp->row[i];
+	if (date_field >= tp->len[r] || keep[r])
+	    tp->row[n++] = r;
     }
+    tp->rows = n;
 
-    return r;
+    free(keep);
+    free(hp);
+    return n;
 }
 
 
@@ -604,7 +2706,7 @@ main(int argc,
     tp = table_create();
     table_load(tp, argv[1], 1);
 
-    table_sort(tp, scol, type);
+    table_sort(tp, scol, type, 1);
     
     table_print_html(tp, scol, stdout);
 
@@ -5,19 +5,102 @@
 #ifndef PTMS_TABLE_H
 #define PTMS_TABLE_H
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/* Heap offset of a cell that the row does not have */
+#define TCELL_NONE	((unsigned int) -1)
+
+/* Per-cell flags: the cell has a numeric value of this kind */
+#define TCELL_INT	0x01
+#define TCELL_DBL	0x02
+
+/* Column types, inferred from the cells at load time */
+#define TCOL_STR	0
+#define TCOL_INT	1
+#define TCOL_DBL	2
+#define TCOL_DATE	3
+#define TCOL_NONE	4	/* Not parsed, see table_project() */
+
 typedef struct
 {
-    char **head;
-    
-    int rows;
+    int type;
+    unsigned int *off;		/* Cell string per row, or TCELL_NONE */
+    unsigned char *flags;	/* TCELL_* per row */
+    int *ival;			/* As parsed by "%d" */
+    double *dval;		/* As parsed by "%lf" */
+} TCOLUMN;
+
+typedef struct
+{
+    char *heap;			/* All cell strings, NUL terminated */
+    size_t heaplen;
+    size_t heapsize;
+
+    unsigned int *head;		/* Header cells, or NULL */
+    int hcols;
+
+    TCOLUMN *col;
+    int cols;
+    int maxcols;
+
+    int *len;			/* Number of cells in each row */
+    int nrows;
     int maxrows;
-    char ***cell;
+
+    int *row;			/* The rows to show, in order */
+    int rows;
+
+    void *map;			/* Snapshot the table points into, or NULL */
+    size_t maplen;
+
+    unsigned char *need;	/* Columns to parse, or NULL for all */
+    int nneed;
+
+    char *path;			/* CSV file the table was loaded from, */
+    int header;			/* when it is all of that file */
+    struct stat st;
+
+    char *nums;			/* Row numbers (cell 0), see table_rownum() */
+
+    unsigned int *itab;		/* Strings in the heap, while loading */
+    size_t isize;
+    size_t icount;
 } TABLE;
 
+/*
+** Cell c of stored row r, or NULL if the row is shorter than that.
+** Cell 0, the row number, is not stored but made when first asked for.
+*/
+#define TABLE_CELL(tp,r,c)	((c) < (tp)->len[r] ? \
+				 ((c) == 0 ? table_rownum(tp, r) : \
+				  (tp)->heap + (tp)->col[c].off[r]) : NULL)
+
+/* Files this large (rows this many) are parsed by several threads */
+#define TLOAD_CHUNK_MIN		(4 << 20)
+#define TLOAD_ROWS_MIN		65536
+#define TLOAD_MAX_THREADS	8
+
+#define TABLE_NEEDS(tp,c)	(!(tp)->need || \
+				 ((c) < (tp)->nneed && (tp)->need[c]))
+
 
 extern TABLE *
 table_create(void);
 
+extern const char *
+table_cell(TABLE *tp,
+	   int row,
+	   int col);
+
+extern const char *
+table_rownum(TABLE *tp,
+	     int row);
+
+extern int
+table_project(TABLE *tp,
+	      int col);
+
 extern int
 table_load(TABLE *tp,
 	   const char *path,
@@ -26,7 +109,28 @@ table_load(TABLE *tp,
 extern int
 table_sort(TABLE *tp,
 	   int col,
-	   int type);
+	   int type,
+	   int dir);
+
+extern int
+table_sort_top(TABLE *tp,
+	       int col,
+	       int type,
+	       int dir,
+	       int k);
+
+/* table_filter() flags */
+#define TFILTER_ICASE	0x01	/* Ignore case (ASCII, Latin letters of UTF-8) */
+#define TFILTER_INDEX	0x02	/* Narrow the rows down by a trigram index */
+
+/* table_*_html() flags, along with the filter flags */
+#define TPRINT_JSON	0x100	/* Print the table as JSON rather than HTML */
+
+extern int
+table_filter(TABLE *tp,
+	     const char *filter,
+	     int field,
+	     int flags);
 
 extern int
 table_print_html(TABLE *tp,
@@ -39,12 +143,65 @@ table_print_html(TABLE *tp,
 		 int striped,
 		 int rows,
 		 int cols,
-		 int skip_header);
+		 int skip_header,
+		 int flags);
+
+extern int
+table_stream_html(const char *path,
+		  int header,
+		  FILE *fp,
+		  const char *opts,
+		  const char *width,
+		  const char *filter,
+		  int field,
+		  int count,
+		  int striped,
+		  int rows,
+		  int cols,
+		  int skip_header,
+		  int flags);
+
+extern int
+table_xsort_html(const char *path,
+		 int header,
+		 FILE *fp,
+		 const char *opts,
+		 const char *width,
+		 const char *filter,
+		 int field,
+		 int count,
+		 int striped,
+		 int rows,
+		 int cols,
+		 int skip_header,
+		 int flags,
+		 int type,
+		 int dir,
+		 size_t mem);
+
+extern int
+table_merge_html(TABLE **tv,
+		 int n,
+		 FILE *fp,
+		 const char *opts,
+		 const char *width,
+		 const char *filter,
+		 int field,
+		 int count,
+		 int striped,
+		 int rows,
+		 int cols,
+		 int skip_header,
+		 int flags,
+		 int type,
+		 int dir);
 
 extern int
 table_date_filter(TABLE *tblp,
 		  int date_field,
-		  int date_range);
+		  int date_range,
+		  time_t now,
+		  time_t *untilp);
 
 extern void
 table_free(TABLE *tp);
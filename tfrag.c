@@ -0,0 +1,266 @@
+/*
+** tfrag.c
+**
+** Cache of rendered tables. The HTML of an x-table directive only
+** depends on the CSV file and the arguments of the directive, so it
+** is kept in "dir/.name.frag-<hash>", where the hash is of a key made
+** of the arguments (see index.c), and sent as it is while the device,
+** inode, size and mtime of the CSV file match the ones it was made
+** from. Tables filtered by date also record when they stop being
+** valid.
+**
+** The file is a TFRAGHDR, the key and the fragment. A fragment is
+** rendered into a temporary file, which is renamed into place once
+** complete and then sent from.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "tsnap.h"
+#include "tfrag.h"
+
+
+#define TFRAG_MAGIC	"PTFRAG\0\0"
+#define TFRAG_VERSION	2
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t keylen;
+
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_ns;
+
+    int64_t until;		/* Valid before this time, or 0 for always */
+    uint64_t len;		/* Of the fragment */
+} TFRAGHDR;
+
+struct TFRAG
+{
+    char *path;			/* CSV file */
+    char *fpath;		/* Its fragment file, */
+    char *tpath;		/* first written here */
+    FILE *fp;
+    TFRAGHDR h;
+};
+
+
+static void
+frag_key(TFRAGHDR *hp,
+	 size_t keylen,
+	 const struct stat *sp)
+{
+    memset(hp, 0, sizeof(*hp));
+    memcpy(hp->magic, TFRAG_MAGIC, sizeof(hp->magic));
+    hp->version = TFRAG_VERSION;
+    hp->keylen = keylen;
+    hp->dev = sp->st_dev;
+    hp->ino = sp->st_ino;
+    hp->size = sp->st_size;
+    hp->mtime = sp->st_mtim.tv_sec;
+    hp->mtime_ns = sp->st_mtim.tv_nsec;
+}
+
+static char *
+frag_path(const char *path,
+	  const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    char ext[32];
+
+
+    for (; *key; ++key)
+	h = (h ^ (unsigned char) *key) * 1099511628211ULL;
+
+    sprintf(ext, "frag-%016llx", (unsigned long long) h);
+    return tsnap_path(path, ext);
+}
+
+static int
+frag_copy(FILE *in,
+	  uint64_t len,
+	  FILE *out)
+{
+    char buf[65536];
+    size_t n;
+
+
+    while (len > 0)
+    {
+	n = fread(buf, 1, len < sizeof(buf) ? len : sizeof(buf), in);
+	if (n == 0 || fwrite(buf, 1, n, out) != n)
+	    return -1;
+	len -= n;
+    }
+    return 0;
+}
+
+/*
+** Send the fragment cached under key for the CSV file path to out.
+** Returns 0, or -1 if there is none that is current at now.
+*/
+int
+tfrag_send(const char *path,
+	   const char *key,
+	   time_t now,
+	   FILE *out)
+{
+    TFRAGHDR h, want;
+    struct stat sb;
+    size_t keylen = strlen(key);
+    char *fpath, *kbuf;
+    FILE *fp;
+    int rc = -1;
+
+
+    if (stat(path, &sb) != 0)
+	return -1;
+
+    fpath = frag_path(path, key);
+    if (!fpath)
+	return -1;
+    fp = fopen(fpath, "r");
+    free(fpath);
+    if (!fp)
+	return -1;
+
+    frag_key(&want, keylen, &sb);
+    kbuf = malloc(keylen + 1);
+
+    if (kbuf && fread(&h, sizeof(h), 1, fp) == 1 &&
+	memcmp(&h, &want, offsetof(TFRAGHDR, until)) == 0 &&
+	(h.until == 0 || now < h.until) &&
+	fstat(fileno(fp), &sb) == 0 &&
+	(uint64_t) sb.st_size == sizeof(h) + keylen + h.len &&
+	fread(kbuf, 1, keylen, fp) == keylen &&
+	memcmp(kbuf, key, keylen) == 0)
+    {
+	/* Once anything is sent, it counts as sent */
+	frag_copy(fp, h.len, out);
+	rc = 0;
+    }
+
+    free(kbuf);
+    fclose(fp);
+    return rc;
+}
+
+static void
+frag_free(TFRAG *fp)
+{
+    free(fp->path);
+    free(fp->fpath);
+    free(fp->tpath);
+    free(fp);
+}
+
+/*
+** Start a fragment to cache under key for the CSV file path. The
+** table is to be rendered into tfrag_file(). Returns NULL if it
+** cannot be cached.
+*/
+TFRAG *
+tfrag_open(const char *path,
+	   const char *key)
+{
+    TFRAG *fp;
+    struct stat sb;
+    size_t keylen = strlen(key);
+
+
+    if (stat(path, &sb) != 0 || !S_ISREG(sb.st_mode))
+	return NULL;
+
+    fp = calloc(1, sizeof(*fp));
+    if (!fp)
+	return NULL;
+
+    fp->path = strdup(path);
+    fp->fpath = frag_path(path, key);
+    if (!fp->path || !fp->fpath ||
+	(fp->tpath = malloc(strlen(fp->fpath) + 32)) == NULL)
+    {
+	frag_free(fp);
+	return NULL;
+    }
+    sprintf(fp->tpath, "%s.tmp.%u", fp->fpath, (unsigned int) getpid());
+
+    fp->fp = fopen(fp->tpath, "w+");
+    if (!fp->fp)
+    {
+	frag_free(fp);
+	return NULL;
+    }
+
+    frag_key(&fp->h, keylen, &sb);
+    if (fwrite(&fp->h, sizeof(fp->h), 1, fp->fp) != 1 ||
+	fwrite(key, 1, keylen, fp->fp) != keylen)
+    {
+	fclose(fp->fp);
+	unlink(fp->tpath);
+	frag_free(fp);
+	return NULL;
+    }
+
+    return fp;
+}
+
+FILE *
+tfrag_file(TFRAG *fp)
+{
+    return fp->fp;
+}
+
+/*
+** Store the fragment rendered, valid before until (0 for always),
+** and send it to out. Returns 0, or -1 if it was sent but could not
+** be stored.
+*/
+int
+tfrag_close(TFRAG *fp,
+	    time_t until,
+	    FILE *out)
+{
+    TFRAGHDR now;
+    struct stat sb;
+    off_t start = sizeof(fp->h) + fp->h.keylen;
+    off_t end;
+    int rc = -1;
+
+
+    end = ftello(fp->fp);
+    fp->h.until = until;
+    fp->h.len = (end > start) ? end - start : 0;
+
+    /* Not kept if the CSV file changed while the table was rendered */
+    if (end >= start && stat(fp->path, &sb) == 0)
+    {
+	frag_key(&now, fp->h.keylen, &sb);
+	if (memcmp(&now, &fp->h, offsetof(TFRAGHDR, until)) == 0 &&
+	    fseeko(fp->fp, 0, SEEK_SET) == 0 &&
+	    fwrite(&fp->h, sizeof(fp->h), 1, fp->fp) == 1 &&
+	    fflush(fp->fp) == 0 &&
+	    rename(fp->tpath, fp->fpath) == 0)
+	    rc = 0;
+    }
+    if (rc < 0)
+	unlink(fp->tpath);
+
+    if (fseeko(fp->fp, start, SEEK_SET) == 0)
+	frag_copy(fp->fp, fp->h.len, out);
+
+    fclose(fp->fp);
+    frag_free(fp);
+    return rc;
+}
@@ -0,0 +1,31 @@
+/*
+** tfrag.h
+*/
+
+#ifndef PTMS_TFRAG_H
+#define PTMS_TFRAG_H
+
+#include <stdio.h>
+#include <time.h>
+
+typedef struct TFRAG TFRAG;
+
+extern int
+tfrag_send(const char *path,
+	   const char *key,
+	   time_t now,
+	   FILE *out);
+
+extern TFRAG *
+tfrag_open(const char *path,
+	   const char *key);
+
+extern FILE *
+tfrag_file(TFRAG *fp);
+
+extern int
+tfrag_close(TFRAG *fp,
+	    time_t until,
+	    FILE *out);
+
+#endif
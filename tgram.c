@@ -0,0 +1,364 @@
+/*
+** tgram.c
+**
+** Trigram index for table filters. For every trigram (three bytes)
+** in the cells searched by a filter the index lists the rows that
+** have it, so a filter string of three bytes or more only has to be
+** verified against the rows that have all of its trigrams. Indexes
+** are made on first use and stored in the side file of the table
+** (see tsnap.c), which is rebuilt when the CSV file changes.
+**
+** Case-insensitive indexes are made over folded text: ASCII and the
+** Latin-1 and Latin Extended-A letters of UTF-8 are folded to lower
+** case. Folding keeps the length, so byte trigrams still work for
+** UTF-8 text.
+**
+** The stored form is a TGRAMHDR followed by the ntri trigrams in
+** ascending order, ntri+1 start positions and the npost row lists.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "table.h"
+#include "tsnap.h"
+#include "tgram.h"
+
+
+typedef struct
+{
+    int32_t ntri;
+    int32_t npost;
+} TGRAMHDR;
+
+#define TGRAM_KEY(hp)		((uint32_t *) ((hp) + 1))
+#define TGRAM_START(hp)		(TGRAM_KEY(hp) + (hp)->ntri)
+#define TGRAM_ROW(hp)		((int32_t *) (TGRAM_START(hp) + (hp)->ntri + 1))
+
+#define TGRAM(p)	(((uint32_t) (unsigned char) (p)[0] << 16) | \
+			 ((uint32_t) (unsigned char) (p)[1] << 8) | \
+			 (uint32_t) (unsigned char) (p)[2])
+
+
+/*
+** Fold len bytes of UTF-8 text at src to lower case into dst, which
+** may be src. Bytes that are not part of a letter that has a lower
+** case form of the same length are copied as is.
+*/
+void
+tgram_fold(char *dst,
+	   const char *src,
+	   size_t len)
+{
+    unsigned char c, d;
+    unsigned int u;
+    size_t i;
+
+
+    for (i = 0; i < len; ++i)
+    {
+	c = src[i];
+	if (c < 0x80)
+	{
+	    dst[i] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+	    continue;
+	}
+
+	d = (i+1 < len) ? src[i+1] : 0;
+	if ((c == 0xC3 || c == 0xC4 || c == 0xC5) && (d & 0xC0) == 0x80)
+	{
+	    u = ((c & 0x1F) << 6) | (d & 0x3F);
+
+	    if (u >= 0xC0 && u <= 0xDE && u != 0xD7)
+		u += 0x20;
+	    else if ((u >= 0x100 && u <= 0x137) || (u >= 0x14A && u <= 0x177))
+		u |= 1;
+	    else if ((u >= 0x139 && u <= 0x148) || (u >= 0x179 && u <= 0x17E))
+		u += (u & 1);
+
+	    dst[i] = 0xC0 | (u >> 6);
+	    dst[++i] = 0x80 | (u & 0x3F);
+	    continue;
+	}
+
+	dst[i] = c;
+    }
+}
+
+
+static int
+post_cmp(const void *a,
+	 const void *b)
+{
+    uint64_t p1 = *(const uint64_t *) a, p2 = *(const uint64_t *) b;
+
+
+    return p1 < p2 ? -1 : p1 > p2;
+}
+
+/* Add the (trigram, row) pairs of a cell to pv */
+static int
+post_add(uint64_t **pvp,
+	 size_t *np,
+	 size_t *sizep,
+	 const char *s,
+	 size_t len,
+	 int r)
+{
+    uint64_t *npv;
+    size_t i;
+
+
+    if (len < 3)
+	return 0;
+
+    if (*np + len > *sizep)
+    {
+	*sizep = (*sizep ? *sizep * 2 : 65536) + len;
+	npv = realloc(*pvp, *sizep * sizeof(uint64_t));
+	if (!npv)
+	    return -1;
+	*pvp = npv;
+    }
+
+    for (i = 0; i+2 < len; ++i)
+	(*pvp)[(*np)++] = ((uint64_t) TGRAM(s+i) << 32) | (uint32_t) r;
+
+    return 0;
+}
+
+/*
+** Make the index of the cells of column field (all cells if it is
+** negative), folded if icase.
+*/
+static TGRAMHDR *
+tgram_make(TABLE *tp,
+	   int field,
+	   int icase,
+	   size_t *lenp)
+{
+    TGRAMHDR *hp = NULL;
+    uint64_t *pv = NULL;
+    size_t n = 0, size = 0, i, j, len;
+    char *buf = NULL, *nbuf;
+    size_t bufsize = 0;
+    int32_t ntri, npost;
+    int r, c, c0, c1;
+    const char *s;
+
+
+    for (r = 0; r < tp->nrows; ++r)
+    {
+	c0 = field < 0 ? 0 : field;
+	c1 = field < 0 ? tp->len[r] : field+1;
+	if (c1 > tp->len[r])
+	    c1 = tp->len[r];
+
+	for (c = c0; c < c1; ++c)
+	{
+	    s = TABLE_CELL(tp, r, c);
+	    len = strlen(s);
+	    if (icase)
+	    {
+		if (len + 1 > bufsize)
+		{
+		    bufsize = len + 1024;
+		    nbuf = realloc(buf, bufsize);
+		    if (!nbuf)
+			goto Fail;
+		    buf = nbuf;
+		}
+		tgram_fold(buf, s, len);
+		s = buf;
+	    }
+
+	    if (post_add(&pv, &n, &size, s, len, r) < 0)
+		goto Fail;
+	}
+    }
+
+    /* Sorted by trigram and row, without duplicates */
+    qsort(pv, n, sizeof(uint64_t), post_cmp);
+    for (i = j = 0; i < n; ++i)
+	if (j == 0 || pv[i] != pv[j-1])
+	    pv[j++] = pv[i];
+    n = j;
+
+    for (i = ntri = 0; i < n; ++i)
+	if (i == 0 || (pv[i] >> 32) != (pv[i-1] >> 32))
+	    ++ntri;
+    npost = n;
+
+    *lenp = sizeof(*hp) + (2 * ntri + 1) * sizeof(uint32_t) + npost * sizeof(int32_t);
+    hp = malloc(*lenp);
+    if (!hp)
+	goto Fail;
+    hp->ntri = ntri;
+    hp->npost = npost;
+
+    for (i = 0, j = 0; i < n; ++i)
+    {
+	if (i == 0 || (pv[i] >> 32) != (pv[i-1] >> 32))
+	{
+	    TGRAM_KEY(hp)[j] = pv[i] >> 32;
+	    TGRAM_START(hp)[j++] = i;
+	}
+	TGRAM_ROW(hp)[i] = (int32_t) (pv[i] & 0xFFFFFFFF);
+    }
+    TGRAM_START(hp)[ntri] = npost;
+
+  Fail:
+    free(buf);
+    free(pv);
+    return hp;
+}
+
+/* The index for the filter, made and stored on first use */
+static TGRAMHDR *
+tgram_get(TABLE *tp,
+	  int field,
+	  int icase)
+{
+    TGRAMHDR *hp;
+    void *data;
+    size_t len;
+    int type = TSNAP_TRIGRAMS | (icase ? 1 : 0);
+
+
+    if (field < 0)
+	field = -1;
+
+    if (tsnap_side_load(tp, field, type, 0, &data, &len) == 1)
+    {
+	hp = data;
+	if (len >= sizeof(*hp) && hp->ntri >= 0 && hp->npost >= 0 &&
+	    len == sizeof(*hp) + (2 * (size_t) hp->ntri + 1) * sizeof(uint32_t) +
+	    hp->npost * sizeof(int32_t))
+	    return hp;
+	free(data);
+    }
+
+    hp = tgram_make(tp, field, icase, &len);
+    if (hp)
+	tsnap_side_save(tp, field, type, 0, hp, len);
+    return hp;
+}
+
+/* The row list of trigram t, as [*lop, *hip) */
+static int
+tgram_find(TGRAMHDR *hp,
+	   uint32_t t,
+	   int *lop,
+	   int *hip)
+{
+    int lo = 0, hi = hp->ntri, i;
+
+
+    while (lo < hi)
+    {
+	i = lo + (hi - lo) / 2;
+	if (TGRAM_KEY(hp)[i] < t)
+	    lo = i + 1;
+	else
+	    hi = i;
+    }
+
+    if (lo >= hp->ntri || TGRAM_KEY(hp)[lo] != t)
+	return -1;
+
+    *lop = TGRAM_START(hp)[lo];
+    *hip = TGRAM_START(hp)[lo+1];
+    return 0;
+}
+
+/* Is row in the sorted list [lo, hi) */
+static int
+tgram_has(const int32_t *rv,
+	  int lo,
+	  int hi,
+	  int row)
+{
+    int end = hi, i;
+
+
+    while (lo < hi)
+    {
+	i = lo + (hi - lo) / 2;
+	if (rv[i] < row)
+	    lo = i + 1;
+	else
+	    hi = i;
+    }
+
+    return lo < end && rv[lo] == row;
+}
+
+/*
+** Mark the rows that may match the filter (already folded if icase)
+** in cand[], which has room for all rows. Returns the number of rows
+** marked, or -1 if the index cannot narrow the filter down.
+*/
+int
+tgram_candidates(TABLE *tp,
+		 const char *filter,
+		 int field,
+		 int icase,
+		 unsigned char *cand)
+{
+    TGRAMHDR *hp;
+    int32_t *rv;
+    int *lo, *hi;
+    size_t len = strlen(filter);
+    int i, j, k, m, best, n = 0;
+
+
+    if (len < 3 || !tp->path)
+	return -1;
+
+    hp = tgram_get(tp, field, icase);
+    if (!hp)
+	return -1;
+
+    lo = malloc(len * sizeof(int));
+    hi = malloc(len * sizeof(int));
+    if (!lo || !hi)
+    {
+	free(lo);
+	free(hi);
+	free(hp);
+	return -1;
+    }
+
+    rv = TGRAM_ROW(hp);
+    for (m = 0, i = 0; i+2 < len; ++i)
+    {
+	if (tgram_find(hp, TGRAM(filter+i), &lo[m], &hi[m]) < 0)
+	    goto End;
+	++m;
+    }
+
+    /* Walk the shortest list, looking the rows up in the others */
+    for (best = 0, j = 1; j < m; ++j)
+	if (hi[j] - lo[j] < hi[best] - lo[best])
+	    best = j;
+
+    for (i = lo[best]; i < hi[best]; ++i)
+    {
+	for (k = 0; k < m; ++k)
+	    if (k != best && !tgram_has(rv, lo[k], hi[k], rv[i]))
+		break;
+	if (k == m)
+	{
+	    cand[rv[i]] = 1;
+	    ++n;
+	}
+    }
+
+  End:
+    free(lo);
+    free(hi);
+    free(hp);
+    return n;
+}
@@ -0,0 +1,22 @@
+/*
+** tgram.h
+*/
+
+#ifndef PTMS_TGRAM_H
+#define PTMS_TGRAM_H
+
+#include "table.h"
+
+extern void
+tgram_fold(char *dst,
+	   const char *src,
+	   size_t len);
+
+extern int
+tgram_candidates(TABLE *tp,
+		 const char *filter,
+		 int field,
+		 int icase,
+		 unsigned char *cand);
+
+#endif
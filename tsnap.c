@@ -0,0 +1,874 @@
+/*
+** tsnap.c
+**
+** Snapshots of loaded tables. A snapshot holds the parsed form of a
+** CSV file (header, row lengths, typed columns and the string heap)
+** in the layout TABLE uses, so a later load maps it and points the
+** table into it instead of parsing the CSV again. A snapshot is only
+** used while the device, inode, size and mtime of the CSV file match
+** the ones it was made from. Snapshots are written to a temporary
+** name and renamed into place.
+**
+** A snapshot also records how much of the file it holds and a hash
+** of that part. When the file has only been appended to since (same
+** inode, not smaller, same hash), the snapshot is read in and only the
+** rows after it are parsed. Hashing reads the part again, but costs
+** far less than parsing it.
+**
+** The file is a TSNAPHDR followed by these sections, each starting
+** at a multiple of 8 bytes:
+**
+**	head[hcols], len[nrows], type[cols],
+**	off[nrows], flags[nrows], ival[nrows], dval[nrows] per column,
+**	heap[heaplen]
+**
+** Data derived from a table, such as sort permutations and date
+** indexes, is kept in ".name.perm", keyed the same way. There the
+** header is followed by a TSPERM for each of the cols entries, and
+** then by the data of each entry that has any, in the same order.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "table.h"
+#include "tsnap.h"
+#include "collate.h"
+
+
+#define TSNAP_MAGIC	"PTSNAP\0\0"
+#define TSPERM_MAGIC	"PTPERM\0\0"
+#define TSNAP_VERSION	5
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header;
+
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_ns;
+
+    uint32_t nrows;
+    uint32_t cols;
+    uint32_t hcols;
+    uint32_t pad;
+    uint64_t heaplen;
+
+    uint64_t offset;		/* Bytes of the file parsed */
+    uint64_t hash;		/* Of those, see snap_hash(), or 0 */
+} TSNAPHDR;
+
+typedef struct
+{
+    int32_t col;
+    int32_t type;		/* Sort type, or TSNAP_DATES */
+    int32_t total;		/* Has data (for sorts: usable for any subset) */
+    uint32_t tz;		/* Time zone or collation it depends on, or 0 */
+    uint64_t len;
+} TSPERM;
+
+
+#define ALIGN8(n)	(((n) + 7) & ~(size_t) 7)
+
+
+/*
+** The path of the file with extension ext that belongs to the CSV
+** file path: "dir/.name.ext".
+*/
+char *
+tsnap_path(const char *path,
+	   const char *ext)
+{
+    const char *base;
+    char *p;
+
+
+    base = strrchr(path, '/');
+    base = base ? base+1 : path;
+
+    p = malloc(strlen(path) + strlen(ext) + 3);
+    if (!p)
+	return NULL;
+
+    sprintf(p, "%.*s.%s.%s", (int) (base - path), path, base, ext);
+    return p;
+}
+
+static void
+snap_key(TSNAPHDR *hp,
+	 const char *magic,
+	 int header,
+	 const struct stat *sp)
+{
+    memset(hp, 0, sizeof(*hp));
+    memcpy(hp->magic, magic, sizeof(hp->magic));
+    hp->version = TSNAP_VERSION;
+    hp->header = header ? 1 : 0;
+    hp->dev = sp->st_dev;
+    hp->ino = sp->st_ino;
+    hp->size = sp->st_size;
+    hp->mtime = sp->st_mtim.tv_sec;
+    hp->mtime_ns = sp->st_mtim.tv_nsec;
+}
+
+static size_t
+snap_size(const TSNAPHDR *hp)
+{
+    size_t n = hp->nrows;
+
+
+    return ALIGN8(sizeof(*hp)) +
+	ALIGN8(hp->hcols * sizeof(unsigned int)) +
+	ALIGN8(n * sizeof(int)) +
+	ALIGN8(hp->cols * sizeof(int)) +
+	hp->cols * (ALIGN8(n * sizeof(unsigned int)) +
+		    ALIGN8(n) +
+		    ALIGN8(n * sizeof(int)) +
+		    ALIGN8(n * sizeof(double))) +
+	hp->heaplen;
+}
+
+
+/*
+** Hash of the first off bytes of the file fd, or 0 if they cannot be
+** read: FNV-1a, but taking 8 bytes at a time.
+*/
+static uint64_t
+snap_hash(int fd,
+	  uint64_t off)
+{
+    unsigned char buf[65536];
+    uint64_t h = 14695981039346656037ULL, w, pos = 0;
+    ssize_t rc, i;
+
+
+    while (pos < off)
+    {
+	rc = pread(fd, buf, off - pos < sizeof(buf) ? off - pos : sizeof(buf), pos);
+	if (rc <= 0)
+	    return 0;
+	for (i = 0; i + 8 <= rc; i += 8)
+	{
+	    memcpy(&w, buf + i, 8);
+	    h = (h ^ w) * 1099511628211ULL;
+	}
+	for (; i < rc; ++i)
+	    h = (h ^ buf[i]) * 1099511628211ULL;
+	pos += rc;
+    }
+
+    return h ? h : 1;
+}
+
+/*
+** Can the rows after the snapshot hp be parsed on top of it, for the
+** file path stat()ed as *sp: has the file only grown?
+*/
+static int
+snap_resumable(const TSNAPHDR *hp,
+	       const char *path,
+	       const struct stat *sp)
+{
+    unsigned char eol[2];
+    int fd, rc = 0;
+
+
+    if (!hp->hash || hp->offset == 0 || hp->offset > hp->size ||
+	hp->size > (uint64_t) sp->st_size)
+	return 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+	return 0;
+
+    if (snap_hash(fd, hp->offset) == hp->hash)
+    {
+	rc = 1;
+
+	/* A line end at the old end of file may be half of a pair now */
+	if (hp->offset == hp->size &&
+	    pread(fd, eol, 2, hp->offset - 1) == 2 &&
+	    ((eol[0] == '\r' && eol[1] == '\n') || (eol[0] == '\n' && eol[1] == '\r')))
+	    rc = 0;
+    }
+
+    close(fd);
+    return rc;
+}
+
+/*
+** Map the snapshot of the CSV file path, which was stat()ed as *sp.
+** With resume, one of the file before rows were appended to it will
+** do. Returns the header, or NULL.
+*/
+static TSNAPHDR *
+snap_map(TABLE *tp,
+	 const char *path,
+	 int header,
+	 const struct stat *sp,
+	 int resume,
+	 size_t *sizep)
+{
+    TSNAPHDR key, *hp;
+    struct stat sb;
+    char *spath, *base, *p;
+    int *types;
+    int fd, c;
+
+
+    spath = tsnap_path(path, "snap");
+    if (!spath)
+	return NULL;
+    fd = open(spath, O_RDONLY);
+    free(spath);
+    if (fd < 0)
+	return NULL;
+
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t) sizeof(TSNAPHDR))
+    {
+	close(fd);
+	return NULL;
+    }
+
+    base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+	return NULL;
+
+    hp = (TSNAPHDR *) base;
+    snap_key(&key, TSNAP_MAGIC, header, sp);
+    if (memcmp(hp, &key, offsetof(TSNAPHDR, size)) != 0 ||
+	snap_size(hp) != (size_t) sb.st_size)
+	goto Fail;
+
+    if (resume ? !snap_resumable(hp, path, sp) :
+	memcmp(hp, &key, offsetof(TSNAPHDR, nrows)) != 0)
+	goto Fail;
+
+    p = base + ALIGN8(sizeof(*hp));
+    types = (int *) (p + ALIGN8(hp->hcols * sizeof(unsigned int)) +
+		     ALIGN8(hp->nrows * sizeof(int)));
+
+    /* Reparse with the columns the snapshot has, and the ones it lacks */
+    for (c = 0; c < (int) hp->cols; ++c)
+	if (types[c] == TCOL_NONE && TABLE_NEEDS(tp, c))
+	{
+	    for (c = 0; tp->need && c < (int) hp->cols; ++c)
+		if (types[c] != TCOL_NONE)
+		    table_project(tp, c);
+	    goto Fail;
+	}
+
+    *sizep = sb.st_size;
+    return hp;
+
+  Fail:
+    munmap(base, sb.st_size);
+    return NULL;
+}
+
+/*
+** Point an empty table into the snapshot of the CSV file path,
+** which was stat()ed as *sp. Returns 0, or -1 if there is no
+** snapshot matching the file.
+*/
+int
+tsnap_load(TABLE *tp,
+	   const char *path,
+	   int header,
+	   const struct stat *sp)
+{
+    TSNAPHDR *hp;
+    TCOLUMN *col = NULL;
+    char *base, *p;
+    int *types;
+    size_t n, size;
+    int c;
+
+
+    hp = snap_map(tp, path, header, sp, 0, &size);
+    if (!hp)
+	return -1;
+    base = (char *) hp;
+
+    n = hp->nrows;
+    p = base + ALIGN8(sizeof(*hp));
+    types = (int *) (p + ALIGN8(hp->hcols * sizeof(unsigned int)) +
+		     ALIGN8(n * sizeof(int)));
+
+    if (hp->cols)
+    {
+	col = calloc(hp->cols, sizeof(TCOLUMN));
+	if (!col)
+	    goto Fail;
+    }
+
+    tp->head = hp->hcols ? (unsigned int *) p : NULL;
+    tp->hcols = hp->hcols;
+    p += ALIGN8(hp->hcols * sizeof(unsigned int));
+
+    tp->len = (int *) p;
+    p += ALIGN8(n * sizeof(int));
+
+    for (c = 0; c < (int) hp->cols; ++c)
+	col[c].type = types[c];
+    p += ALIGN8(hp->cols * sizeof(int));
+
+    for (c = 0; c < (int) hp->cols; ++c)
+    {
+	col[c].off = (unsigned int *) p;
+	p += ALIGN8(n * sizeof(unsigned int));
+	col[c].flags = (unsigned char *) p;
+	p += ALIGN8(n);
+	col[c].ival = (int *) p;
+	p += ALIGN8(n * sizeof(int));
+	col[c].dval = (double *) p;
+	p += ALIGN8(n * sizeof(double));
+    }
+
+    tp->heap = p;
+    tp->heaplen = tp->heapsize = hp->heaplen;
+    tp->col = col;
+    tp->cols = tp->maxcols = hp->cols;
+    tp->nrows = tp->maxrows = n;
+    tp->map = base;
+    tp->maplen = size;
+    return 0;
+
+  Fail:
+    munmap(base, size);
+    return -1;
+}
+
+/* A malloc()ed copy of len bytes at p, in size bytes */
+static void *
+dup_mem(const void *p,
+	size_t len,
+	size_t size)
+{
+    void *d;
+
+
+    d = calloc(1, size ? size : 1);
+    if (d && len)
+	memcpy(d, p, len);
+    return d;
+}
+
+/*
+** Read the snapshot of an earlier state of the CSV file path, stat()ed
+** as *sp, into an empty table, that the rows appended since can then
+** be parsed into. Returns the offset in the file to go on at, or -1
+** if there is no such snapshot.
+*/
+off_t
+tsnap_resume(TABLE *tp,
+	     const char *path,
+	     int header,
+	     const struct stat *sp)
+{
+    TSNAPHDR *hp;
+    TCOLUMN *col;
+    char *p;
+    int *types;
+    size_t n, size, len;
+    int c, none = 0;
+    off_t off;
+
+
+    hp = snap_map(tp, path, header, sp, 1, &size);
+    if (!hp)
+	return -1;
+
+    n = hp->nrows;
+    col = calloc(hp->cols + 1, sizeof(TCOLUMN));
+    if (!col)
+	goto Fail;
+
+    p = (char *) hp + ALIGN8(sizeof(*hp));
+    len = hp->hcols * sizeof(unsigned int);
+    tp->head = hp->hcols ? dup_mem(p, len, len) : NULL;
+    tp->hcols = hp->hcols;
+    p += ALIGN8(hp->hcols * sizeof(unsigned int));
+
+    tp->len = dup_mem(p, n * sizeof(int), n * sizeof(int));
+    p += ALIGN8(n * sizeof(int));
+
+    types = (int *) p;
+    for (c = 0; c < (int) hp->cols; ++c)
+	col[c].type = types[c];
+    p += ALIGN8(hp->cols * sizeof(int));
+
+    tp->col = col;
+    tp->cols = tp->maxcols = hp->cols;
+    tp->nrows = tp->maxrows = n;
+
+    for (c = 0; c < (int) hp->cols; ++c)
+    {
+	col[c].off = dup_mem(p, n * sizeof(unsigned int), n * sizeof(unsigned int));
+	p += ALIGN8(n * sizeof(unsigned int));
+	col[c].flags = dup_mem(p, n, n + 1);
+	p += ALIGN8(n);
+	col[c].ival = dup_mem(p, n * sizeof(int), (n + 1) * sizeof(int));
+	p += ALIGN8(n * sizeof(int));
+	col[c].dval = dup_mem(p, n * sizeof(double), (n + 1) * sizeof(double));
+	p += ALIGN8(n * sizeof(double));
+
+	if (!col[c].off || !col[c].flags || !col[c].ival || !col[c].dval)
+	    goto Fail;
+	if (col[c].type == TCOL_NONE)
+	    none = 1;
+    }
+
+    tp->heap = dup_mem(p, hp->heaplen, hp->heaplen);
+    tp->heaplen = tp->heapsize = hp->heaplen;
+    if (!tp->len || (hp->hcols && !tp->head) || !tp->heap)
+	goto Fail;
+
+    /* The new rows get the columns the old ones have */
+    if (none)
+    {
+	for (c = 0; c < (int) hp->cols; ++c)
+	    if (col[c].type != TCOL_NONE)
+		table_project(tp, c);
+    }
+    else if (tp->need)
+    {
+	free(tp->need);
+	tp->need = NULL;
+	tp->nneed = 0;
+    }
+
+    off = hp->offset;
+    munmap(hp, size);
+    return off;
+
+  Fail:
+    /* Leave the table empty, for a full load */
+    for (c = 0; col && c < (int) hp->cols; ++c)
+    {
+	free(col[c].off);
+	free(col[c].flags);
+	free(col[c].ival);
+	free(col[c].dval);
+    }
+    free(col);
+    free(tp->head);
+    free(tp->len);
+    free(tp->heap);
+    tp->head = NULL;
+    tp->len = NULL;
+    tp->heap = NULL;
+    tp->col = NULL;
+    tp->hcols = tp->cols = tp->maxcols = tp->nrows = tp->maxrows = 0;
+    tp->heaplen = tp->heapsize = 0;
+    munmap(hp, size);
+    return -1;
+}
+
+
+/* Pad a section of len bytes out to a multiple of 8 */
+static int
+snap_pad(FILE *fp,
+	 size_t len)
+{
+    static const char zero[8];
+    size_t pad = ALIGN8(len) - len;
+
+
+    if (pad && fwrite(zero, 1, pad, fp) != pad)
+	return -1;
+    return 0;
+}
+
+/* Temporary name to write the file path under */
+static char *
+snap_tmp(const char *path)
+{
+    char *tpath;
+
+
+    tpath = malloc(strlen(path) + 32);
+    if (tpath)
+	sprintf(tpath, "%s.tmp.%u", path, (unsigned int) getpid());
+    return tpath;
+}
+
+static int
+snap_write(FILE *fp,
+	   const void *buf,
+	   size_t len)
+{
+    if (len && fwrite(buf, 1, len, fp) != len)
+	return -1;
+    return snap_pad(fp, len);
+}
+
+/*
+** Write the snapshot of a table freshly loaded from the CSV file
+** path, which was stat()ed as *sp, and whose first off bytes hold
+** the rows.
+*/
+int
+tsnap_save(TABLE *tp,
+	   const char *path,
+	   int header,
+	   const struct stat *sp,
+	   off_t off)
+{
+    TSNAPHDR h;
+    struct stat sb;
+    char *spath, *tpath;
+    FILE *fp;
+    size_t n = tp->nrows;
+    int c, fd, rc = -1;
+
+
+    spath = tsnap_path(path, "snap");
+    if (!spath)
+	return -1;
+    tpath = snap_tmp(spath);
+    if (!tpath)
+    {
+	free(spath);
+	return -1;
+    }
+
+    fp = fopen(tpath, "w");
+    if (!fp)
+	goto End;
+
+    snap_key(&h, TSNAP_MAGIC, header, sp);
+    h.nrows = tp->nrows;
+    h.cols = tp->cols;
+    h.hcols = tp->hcols;
+    h.heaplen = tp->heaplen;
+
+    /* Only while it is still the file that was read */
+    h.offset = off;
+    fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+	if (fstat(fd, &sb) == 0 && sb.st_ino == sp->st_ino && sb.st_size >= off)
+	    h.hash = snap_hash(fd, off);
+	close(fd);
+    }
+
+    if (snap_write(fp, &h, sizeof(h)) < 0 ||
+	snap_write(fp, tp->head, tp->hcols * sizeof(unsigned int)) < 0 ||
+	snap_write(fp, tp->len, n * sizeof(int)) < 0)
+	goto Close;
+
+    for (c = 0; c < tp->cols; ++c)
+	if (fwrite(&tp->col[c].type, sizeof(int), 1, fp) != 1)
+	    goto Close;
+    if (snap_pad(fp, tp->cols * sizeof(int)) < 0)
+	goto Close;
+
+    for (c = 0; c < tp->cols; ++c)
+	if (snap_write(fp, tp->col[c].off, n * sizeof(unsigned int)) < 0 ||
+	    snap_write(fp, tp->col[c].flags, n) < 0 ||
+	    snap_write(fp, tp->col[c].ival, n * sizeof(int)) < 0 ||
+	    snap_write(fp, tp->col[c].dval, n * sizeof(double)) < 0)
+	    goto Close;
+
+    if (tp->heaplen && fwrite(tp->heap, 1, tp->heaplen, fp) != tp->heaplen)
+	goto Close;
+
+    if (fclose(fp) == 0 && rename(tpath, spath) == 0)
+	rc = 0;
+    else
+	unlink(tpath);
+    goto End;
+
+  Close:
+    fclose(fp);
+    unlink(tpath);
+  End:
+    free(tpath);
+    free(spath);
+    return rc;
+}
+
+
+/*
+** Map the side file of a table, if it is current. Returns the
+** header, or NULL.
+*/
+static TSNAPHDR *
+perm_map(TABLE *tp,
+	 size_t *sizep)
+{
+    TSNAPHDR key, *hp;
+    struct stat sb;
+    char *ppath, *base;
+    size_t size;
+    TSPERM *pv;
+    int fd, i;
+
+
+    ppath = tsnap_path(tp->path, "perm");
+    if (!ppath)
+	return NULL;
+    fd = open(ppath, O_RDONLY);
+    free(ppath);
+    if (fd < 0)
+	return NULL;
+
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t) sizeof(TSNAPHDR))
+    {
+	close(fd);
+	return NULL;
+    }
+
+    base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+	return NULL;
+
+    hp = (TSNAPHDR *) base;
+    snap_key(&key, TSPERM_MAGIC, tp->header, &tp->st);
+    if (memcmp(hp, &key, offsetof(TSNAPHDR, nrows)) != 0 ||
+	hp->nrows != (uint32_t) tp->nrows ||
+	(size_t) sb.st_size < sizeof(*hp) + hp->cols * sizeof(TSPERM))
+	goto Fail;
+
+    pv = (TSPERM *) (base + sizeof(*hp));
+    size = sizeof(*hp) + hp->cols * sizeof(TSPERM);
+    for (i = 0; i < (int) hp->cols; ++i)
+	if (pv[i].total)
+	    size += ALIGN8(pv[i].len);
+    if (size != (size_t) sb.st_size)
+	goto Fail;
+
+    *sizep = size;
+    return hp;
+
+  Fail:
+    munmap(base, sb.st_size);
+    return NULL;
+}
+
+/*
+** Get the data stored for (col, type) of the table into a malloc()ed
+** *datap of *lenp bytes. Returns 1 if there is some, 0 if it is known
+** that there is none, or -1 if nothing is stored for time zone tz.
+*/
+int
+tsnap_side_load(TABLE *tp,
+		int col,
+		int type,
+		unsigned int tz,
+		void **datap,
+		size_t *lenp)
+{
+    TSNAPHDR *hp;
+    TSPERM *pv;
+    size_t size, off;
+    int i, rc = -1;
+
+
+    if (!tp->path)
+	return -1;
+
+    hp = perm_map(tp, &size);
+    if (!hp)
+	return -1;
+
+    pv = (TSPERM *) (hp + 1);
+    off = sizeof(*hp) + hp->cols * sizeof(TSPERM);
+
+    for (i = 0; i < (int) hp->cols; off += pv[i].total ? ALIGN8(pv[i].len) : 0, ++i)
+    {
+	if (pv[i].col != col || pv[i].type != type)
+	    continue;
+	if (pv[i].tz != tz)
+	    break;
+
+	rc = 0;
+	if (pv[i].total)
+	{
+	    *datap = malloc(pv[i].len + 1);
+	    if (!*datap)
+		rc = -1;
+	    else
+	    {
+		memcpy(*datap, (char *) hp + off, pv[i].len);
+		*lenp = pv[i].len;
+		rc = 1;
+	    }
+	}
+	break;
+    }
+
+    munmap(hp, size);
+    return rc;
+}
+
+/*
+** Store the data for (col, type) of the table, replacing what was
+** there. A NULL data records that there is none.
+*/
+int
+tsnap_side_save(TABLE *tp,
+		int col,
+		int type,
+		unsigned int tz,
+		const void *data,
+		size_t len)
+{
+    TSNAPHDR h, *hp;
+    TSPERM *pv, np;
+    char *ppath, *tpath;
+    size_t size = 0, off;
+    FILE *fp;
+    int i, rc = -1;
+
+
+    if (!tp->path)
+	return -1;
+
+    ppath = tsnap_path(tp->path, "perm");
+    if (!ppath)
+	return -1;
+    tpath = snap_tmp(ppath);
+    if (!tpath)
+    {
+	free(ppath);
+	return -1;
+    }
+
+    hp = perm_map(tp, &size);
+
+    snap_key(&h, TSPERM_MAGIC, tp->header, &tp->st);
+    h.nrows = tp->nrows;
+    h.cols = 1;
+    if (hp)
+	for (i = 0; i < (int) hp->cols; ++i)
+	{
+	    pv = (TSPERM *) (hp + 1) + i;
+	    if (pv->col != col || pv->type != type)
+		++h.cols;
+	}
+
+    memset(&np, 0, sizeof(np));
+    np.col = col;
+    np.type = type;
+    np.total = (data != NULL);
+    np.tz = tz;
+    np.len = data ? len : 0;
+
+    fp = fopen(tpath, "w");
+    if (!fp)
+	goto End;
+
+    if (fwrite(&h, sizeof(h), 1, fp) != 1)
+	goto Close;
+
+    /* Kept entries first, then the new one, and their data likewise */
+    if (hp)
+	for (i = 0; i < (int) hp->cols; ++i)
+	{
+	    pv = (TSPERM *) (hp + 1) + i;
+	    if ((pv->col != col || pv->type != type) &&
+		fwrite(pv, sizeof(*pv), 1, fp) != 1)
+		goto Close;
+	}
+    if (fwrite(&np, sizeof(np), 1, fp) != 1)
+	goto Close;
+
+    if (hp)
+    {
+	off = sizeof(*hp) + hp->cols * sizeof(TSPERM);
+	for (i = 0; i < (int) hp->cols; ++i)
+	{
+	    pv = (TSPERM *) (hp + 1) + i;
+	    if (!pv->total)
+		continue;
+	    if ((pv->col != col || pv->type != type) &&
+		snap_write(fp, (char *) hp + off, pv->len) < 0)
+		goto Close;
+	    off += ALIGN8(pv->len);
+	}
+    }
+    if (data && snap_write(fp, data, len) < 0)
+	goto Close;
+
+    if (fclose(fp) == 0 && rename(tpath, ppath) == 0)
+	rc = 0;
+    else
+	unlink(tpath);
+    goto End;
+
+  Close:
+    fclose(fp);
+    unlink(tpath);
+  End:
+    if (hp)
+	munmap(hp, size);
+    free(tpath);
+    free(ppath);
+    return rc;
+}
+
+
+/* Sorts that may compare strings depend on the collation */
+static unsigned int
+perm_coll(int type)
+{
+    return (type == 1 || type == 2) ? collate_id() : 0;
+}
+
+/*
+** Get the stored ascending permutation for sorting the table on
+** (col, type) into a malloc()ed *permp. Returns 1 if there is one,
+** 0 if the sort is known not to have one (see tsort_perm()), or -1
+** if nothing is stored.
+*/
+int
+tsnap_perm_load(TABLE *tp,
+		int col,
+		int type,
+		int **permp)
+{
+    void *data;
+    size_t len;
+    int rc;
+
+
+    rc = tsnap_side_load(tp, col, type, perm_coll(type), &data, &len);
+    if (rc == 1 && len != tp->nrows * sizeof(int))
+    {
+	free(data);
+	return -1;
+    }
+    if (rc == 1)
+	*permp = data;
+    return rc;
+}
+
+/*
+** Add the permutation for sorting on (col, type) to the stored ones,
+** perm being NULL if the sort has no total order.
+*/
+int
+tsnap_perm_save(TABLE *tp,
+		int col,
+		int type,
+		const int *perm)
+{
+    return tsnap_side_save(tp, col, type, perm_coll(type),
+			   perm, tp->nrows * sizeof(int));
+}
@@ -0,0 +1,68 @@
+/*
+** tsnap.h
+*/
+
+#ifndef PTMS_TSNAP_H
+#define PTMS_TSNAP_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "table.h"
+
+/* Side file entry types of date and trigram indexes; sort types are 1-4 */
+#define TSNAP_DATES	0x100
+#define TSNAP_TRIGRAMS	0x200
+
+extern char *
+tsnap_path(const char *path,
+	   const char *ext);
+
+extern int
+tsnap_load(TABLE *tp,
+	   const char *path,
+	   int header,
+	   const struct stat *sp);
+
+extern off_t
+tsnap_resume(TABLE *tp,
+	     const char *path,
+	     int header,
+	     const struct stat *sp);
+
+extern int
+tsnap_save(TABLE *tp,
+	   const char *path,
+	   int header,
+	   const struct stat *sp,
+	   off_t off);
+
+extern int
+tsnap_side_load(TABLE *tp,
+		int col,
+		int type,
+		unsigned int tz,
+		void **datap,
+		size_t *lenp);
+
+extern int
+tsnap_side_save(TABLE *tp,
+		int col,
+		int type,
+		unsigned int tz,
+		const void *data,
+		size_t len);
+
+extern int
+tsnap_perm_load(TABLE *tp,
+		int col,
+		int type,
+		int **permp);
+
+extern int
+tsnap_perm_save(TABLE *tp,
+		int col,
+		int type,
+		const int *perm);
+
+#endif
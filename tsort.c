@@ -0,0 +1,1096 @@
+/*
+** tsort.c
+**
+** Sort engine for table row views. The sort key of every row is
+** extracted once and the keys are LSD radix sorted: ints, doubles and
+** dates on their values, strings on an 8 byte prefix with strcmp()
+** settling longer equal prefixes. Unless the collation is the byte
+** order, strings are sorted on their collation keys, made once for
+** each distinct cell string of the sort (see collate.c). Columns whose cells do not form a
+** total order (mixed "auto" columns, NaN) are merge sorted with the
+** comparators table_sort() has always used, in parallel for large
+** inputs. All state lives in a per-call context, so tables may be
+** sorted concurrently.
+**
+** The resulting order is the ascending one, ties broken on the row
+** number (cell 0), reversed as a whole for descending sorts.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include "table.h"
+#include "tsort.h"
+#include "collate.h"
+
+
+typedef struct
+{
+    TABLE *tp;
+    int col;
+    int (*cmp)(const void *cx, int r1, int r2);
+    char *keys;			/* Collation keys of the cells of col, */
+    size_t *koff;		/* by row, or NULL for byte order */
+} TSCTX;
+
+typedef struct
+{
+    uint64_t key;
+    int row;
+} TSKEY;
+
+typedef struct
+{
+    const TSCTX *cx;
+    int *v;
+    int *tmp;
+    int n;
+    int *b;
+    int nb;
+    int *out;
+} TSJOB;
+
+
+/* Key classes, in sort order */
+#define TS_MISSING	0
+#define TS_NOVALUE	1
+#define TS_VALUE	2
+
+
+static const char *
+ts_cell(const TSCTX *cx,
+	int r,
+	int col)
+{
+    return table_cell(cx->tp, r, col);
+}
+
+/* The string cell col of row r is sorted on */
+static const char *
+ts_str(const TSCTX *cx,
+       int r)
+{
+    return cx->keys ? cx->keys + cx->koff[r] : ts_cell(cx, r, cx->col);
+}
+
+static int
+ts_rownum(const TSCTX *cx,
+	  int r)
+{
+    return cx->tp->col[0].ival[r];
+}
+
+
+/*
+** Comparators, as in the qsort() based table_sort() of old
+** (ascending). Only used where no total order of keys exists.
+*/
+static int
+cmp_auto_col(const TSCTX *cx,
+	     int r1,
+	     int r2,
+	     int col)
+{
+    TCOLUMN *tcp = &cx->tp->col[col];
+    const char *c1, *c2;
+    double d1, d2;
+
+
+    c1 = ts_cell(cx, r1, col);
+    c2 = ts_cell(cx, r2, col);
+
+    if (!c1 && !c2)
+	return 0;
+
+    if (!c1)
+	return -1;
+    if (!c2)
+	return +1;
+
+    if ((tcp->flags[r1] & tcp->flags[r2] & TCELL_DBL))
+    {
+	d1 = tcp->dval[r1];
+	d2 = tcp->dval[r2];
+
+	if (d1 - d2 < 0)
+	    return -1;
+	else if (d1 - d2 > 0)
+	    return +1;
+	else
+	    return 0;
+    }
+
+    if ((tcp->flags[r1] & tcp->flags[r2] & TCELL_INT))
+	return tcp->ival[r1] - tcp->ival[r2];
+
+    if (cx->keys && col == cx->col)
+	return strcmp(ts_str(cx, r1), ts_str(cx, r2));
+
+    return strcmp(c1, c2);
+}
+
+static int
+cmp_auto(const void *vcx,
+	 int r1,
+	 int r2)
+{
+    const TSCTX *cx = vcx;
+    int d;
+
+
+    d = cmp_auto_col(cx, r1, r2, cx->col);
+    if (d || cx->col == 0)
+	return d;
+
+    return cmp_auto_col(cx, r1, r2, 0);
+}
+
+static int
+cmp_dbl(const void *vcx,
+	int r1,
+	int r2)
+{
+    const TSCTX *cx = vcx;
+    TCOLUMN *tcp = &cx->tp->col[cx->col];
+    double d;
+
+
+    if (!ts_cell(cx, r1, cx->col) && !ts_cell(cx, r2, cx->col))
+	return 0;
+
+    if (!ts_cell(cx, r1, cx->col))
+	return -1;
+    if (!ts_cell(cx, r2, cx->col))
+	return +1;
+
+    if (!(tcp->flags[r1] & TCELL_DBL))
+	return -1;
+    if (!(tcp->flags[r2] & TCELL_DBL))
+	return +1;
+
+    d = tcp->dval[r1] - tcp->dval[r2];
+    if (d < 0)
+	return -1;
+    if (d > 0)
+	return +1;
+
+    return cx->col != 0 ? cmp_auto_col(cx, r1, r2, 0) : 0;
+}
+
+static int
+cmp_str(const void *vcx,
+	int r1,
+	int r2)
+{
+    const TSCTX *cx = vcx;
+
+    return strcmp(ts_str(cx, r1), ts_str(cx, r2));
+}
+
+
+/*
+** Stable top-down merge sort of row indices. It splits and merges
+** exactly like the glibc qsort() did, so that even the comparators
+** that are not consistent give the same order as before.
+*/
+static void
+ts_merge(const TSCTX *cx,
+	 int *a,
+	 int na,
+	 int *b,
+	 int nb,
+	 int *out)
+{
+    while (na > 0 && nb > 0)
+    {
+	if (cx->cmp(cx, *a, *b) <= 0)
+	{
+	    *out++ = *a++;
+	    --na;
+	}
+	else
+	{
+	    *out++ = *b++;
+	    --nb;
+	}
+    }
+
+    memcpy(out, a, na * sizeof(int));
+    memcpy(out + na, b, nb * sizeof(int));
+}
+
+static void
+ts_msort(const TSCTX *cx,
+	 int *v,
+	 int *tmp,
+	 int n)
+{
+    int h;
+
+
+    if (n <= 1)
+	return;
+
+    h = n / 2;
+    ts_msort(cx, v, tmp, h);
+    ts_msort(cx, v + h, tmp + h, n - h);
+
+    ts_merge(cx, v, h, v + h, n - h, tmp);
+    memcpy(v, tmp, n * sizeof(int));
+}
+
+static void *
+ts_sort_job(void *vp)
+{
+    TSJOB *jp = vp;
+
+    ts_msort(jp->cx, jp->v, jp->tmp, jp->n);
+    return NULL;
+}
+
+static void *
+ts_merge_job(void *vp)
+{
+    TSJOB *jp = vp;
+
+    ts_merge(jp->cx, jp->v, jp->n, jp->b, jp->nb, jp->out);
+    return NULL;
+}
+
+/*
+** Run the jobs in threads of their own, or here if that fails.
+*/
+static void
+ts_run(TSJOB *jv,
+       int nj,
+       void *(*fun)(void *))
+{
+    pthread_t tid[TSORT_MAX_THREADS];
+    int started[TSORT_MAX_THREADS];
+    int i;
+
+
+    for (i = 1; i < nj; ++i)
+	started[i] = (pthread_create(&tid[i], NULL, fun, &jv[i]) == 0);
+
+    fun(&jv[0]);
+
+    for (i = 1; i < nj; ++i)
+	if (started[i])
+	    pthread_join(tid[i], NULL);
+	else
+	    fun(&jv[i]);
+}
+
+static int
+ts_threads(int n)
+{
+    long ncpu;
+    int nt;
+
+
+    if (n < TSORT_PARALLEL_MIN)
+	return 1;
+
+    /* A power of two, so that the chunks are the halves of halves */
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (nt = 2; nt * 2 <= ncpu && nt * 2 <= TSORT_MAX_THREADS &&
+	     n / (nt * 2) >= TSORT_PARALLEL_MIN / 4; nt *= 2)
+	;
+
+    return nt;
+}
+
+static void
+ts_split(int *start,
+	 int lo,
+	 int hi,
+	 int nt)
+{
+    if (nt == 1)
+    {
+	start[0] = lo;
+	return;
+    }
+
+    ts_split(start, lo, lo + (hi - lo) / 2, nt / 2);
+    ts_split(start + nt / 2, lo + (hi - lo) / 2, hi, nt / 2);
+}
+
+static int
+ts_sort_cmp(const TSCTX *cx,
+	    int *v,
+	    int n)
+{
+    TSJOB jv[TSORT_MAX_THREADS];
+    int start[TSORT_MAX_THREADS+1];
+    int *tmp, *src, *dst, *t;
+    int i, nt, nj;
+
+
+    tmp = malloc((n + 1) * sizeof(int));
+    if (!tmp)
+	return -1;
+
+    nt = ts_threads(n);
+    ts_split(start, 0, n, nt);
+    start[nt] = n;
+
+    for (i = 0; i < nt; ++i)
+    {
+	jv[i].cx = cx;
+	jv[i].v = v + start[i];
+	jv[i].tmp = tmp + start[i];
+	jv[i].n = start[i+1] - start[i];
+    }
+    ts_run(jv, nt, ts_sort_job);
+
+    /* Merge the sorted chunks pairwise, a level at a time */
+    src = v;
+    dst = tmp;
+    while (nt > 1)
+    {
+	for (i = nj = 0; i + 1 < nt; i += 2, ++nj)
+	{
+	    jv[nj].cx = cx;
+	    jv[nj].v = src + start[i];
+	    jv[nj].n = start[i+1] - start[i];
+	    jv[nj].b = src + start[i+1];
+	    jv[nj].nb = start[i+2] - start[i+1];
+	    jv[nj].out = dst + start[i];
+	}
+	ts_run(jv, nj, ts_merge_job);
+
+	for (i = 0; 2*i <= nt; ++i)
+	    start[i] = start[2*i];
+	nt /= 2;
+
+	t = src;
+	src = dst;
+	dst = t;
+    }
+
+    if (src != v)
+	memcpy(v, src, n * sizeof(int));
+
+    free(tmp);
+    return 0;
+}
+
+
+/*
+** Stable LSD radix sort on the 64 bit keys, a byte at a time.
+** Bytes that are the same in all keys are skipped.
+*/
+static void
+ts_radix(TSKEY *kv,
+	 TSKEY *tmp,
+	 int n)
+{
+    int count[256];
+    int i, shift, b, sum, c;
+    TSKEY *src = kv, *dst = tmp, *t;
+
+
+    for (shift = 0; shift < 64; shift += 8)
+    {
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < n; ++i)
+	    ++count[(src[i].key >> shift) & 0xFF];
+
+	if (count[(src[0].key >> shift) & 0xFF] == n)
+	    continue;
+
+	for (sum = b = 0; b < 256; ++b)
+	{
+	    c = count[b];
+	    count[b] = sum;
+	    sum += c;
+	}
+
+	for (i = 0; i < n; ++i)
+	    dst[count[(src[i].key >> shift) & 0xFF]++] = src[i];
+
+	t = src;
+	src = dst;
+	dst = t;
+    }
+
+    if (src != kv)
+	memcpy(kv, src, n * sizeof(TSKEY));
+}
+
+/* Map a double to an unsigned key with the same order */
+static uint64_t
+ts_dblkey(double d)
+{
+    uint64_t u;
+
+
+    d += 0.0;			/* -0 == +0 */
+    memcpy(&u, &d, sizeof(u));
+
+    return (u & 0x8000000000000000ULL) ? ~u : (u | 0x8000000000000000ULL);
+}
+
+static uint64_t
+ts_strkey(const char *s)
+{
+    uint64_t k = 0;
+    int i;
+
+
+    for (i = 0; i < 8; ++i)
+    {
+	k = (k << 8) | (unsigned char) *s;
+	if (*s)
+	    ++s;
+    }
+
+    return k;
+}
+
+
+/*
+** Sort v[] on the given keys, ties kept in input order. With
+** strings, runs of equal 8 byte prefixes are then sorted on the
+** full strings.
+*/
+static int
+ts_sort_keys(const TSCTX *cx,
+	     int *v,
+	     int n,
+	     uint64_t (*keyfun)(const TSCTX *cx, int r))
+{
+    TSKEY *kv;
+    int i, j;
+
+
+    if (n < 2)
+	return 0;
+
+    kv = malloc(2 * n * sizeof(TSKEY));
+    if (!kv)
+	return -1;
+
+    for (i = 0; i < n; ++i)
+    {
+	kv[i].key = keyfun(cx, v[i]);
+	kv[i].row = v[i];
+    }
+
+    ts_radix(kv, kv + n, n);
+
+    for (i = 0; i < n; ++i)
+	v[i] = kv[i].row;
+
+    if (cx->cmp == cmp_str)
+	for (i = 0; i < n; i = j)
+	{
+	    for (j = i+1; j < n && kv[j].key == kv[i].key; ++j)
+		;
+	    if (j - i > 1 && (kv[i].key & 0xFF) && ts_sort_cmp(cx, v + i, j - i) < 0)
+	    {
+		free(kv);
+		return -1;
+	    }
+	}
+
+    free(kv);
+    return 0;
+}
+
+static uint64_t
+key_int(const TSCTX *cx,
+	int r)
+{
+    return (uint32_t) cx->tp->col[cx->col].ival[r] ^ 0x80000000U;
+}
+
+static uint64_t
+key_dbl(const TSCTX *cx,
+	int r)
+{
+    return ts_dblkey(cx->tp->col[cx->col].dval[r]);
+}
+
+static uint64_t
+key_str(const TSCTX *cx,
+	int r)
+{
+    return ts_strkey(ts_str(cx, r));
+}
+
+static uint64_t
+key_rownum(const TSCTX *cx,
+	   int r)
+{
+    return (uint32_t) ts_rownum(cx, r) ^ 0x80000000U;
+}
+
+
+/*
+** Stable partition of v[] into rows without the cell, rows whose
+** cell has no value of the wanted kind (flag) and the rest.
+** Returns the start of the last group, or -1.
+*/
+static int
+ts_partition(const TSCTX *cx,
+	     int *v,
+	     int n,
+	     int flag)
+{
+    TCOLUMN *tcp = &cx->tp->col[cx->col];
+    int pos[3];
+    int *tmp;
+    int i, k;
+
+
+    tmp = malloc((2 * n + 1) * sizeof(int));
+    if (!tmp)
+	return -1;
+
+    pos[0] = pos[1] = pos[2] = 0;
+    for (i = 0; i < n; ++i)
+    {
+	if (!ts_cell(cx, v[i], cx->col))
+	    k = TS_MISSING;
+	else if (flag && !(tcp->flags[v[i]] & flag))
+	    k = TS_NOVALUE;
+	else
+	    k = TS_VALUE;
+	tmp[n + i] = k;
+	++pos[k];
+    }
+
+    pos[2] = pos[0] + pos[1];
+    pos[1] = pos[0];
+    pos[0] = 0;
+    k = pos[2];
+
+    for (i = 0; i < n; ++i)
+	tmp[pos[tmp[n + i]]++] = v[i];
+    memcpy(v, tmp, n * sizeof(int));
+
+    free(tmp);
+    return k;
+}
+
+
+/*
+** Decide how to sort on cx->col. Returns 0 with the key function and
+** the value flag (see ts_partition) for a keyed sort, 1 if the
+** comparator in cx->cmp has to be used, and -1 if the column does
+** not exist (all rows compare equal).
+*/
+static int
+ts_plan(TSCTX *cx,
+	int *row,
+	int n,
+	int type,
+	uint64_t (**keyfun)(const TSCTX *cx, int r),
+	int *flag)
+{
+    TCOLUMN *tcp;
+    int i, nnum, nstr, nnan;
+
+
+    if (cx->col >= cx->tp->cols)
+	return -1;
+
+    tcp = &cx->tp->col[cx->col];
+    nnum = nstr = nnan = 0;
+    for (i = 0; i < n; ++i)
+    {
+	if (!ts_cell(cx, row[i], cx->col))
+	    continue;
+	if (tcp->flags[row[i]] & TCELL_DBL)
+	{
+	    ++nnum;
+	    if (tcp->dval[row[i]] != tcp->dval[row[i]])
+		++nnan;
+	}
+	else
+	    ++nstr;
+    }
+
+    cx->cmp = NULL;
+    *flag = 0;
+
+    switch (type)
+    {
+      case 1:
+	if (nnan || (nnum && nstr))
+	{
+	    /* Numbers and strings do not form a total order here */
+	    cx->cmp = cmp_auto;
+	    return 1;
+	}
+	if (nnum)
+	    *keyfun = key_dbl;
+	else
+	{
+	    cx->cmp = cmp_str;
+	    *keyfun = key_str;
+	}
+	return 0;
+
+      case 2:
+	cx->cmp = cmp_str;
+	*keyfun = key_str;
+	return 0;
+
+      case 3:
+	*flag = TCELL_INT;
+	*keyfun = key_int;
+	return 0;
+
+      default:
+	if (nnan)
+	{
+	    /* NaN compares equal to every number */
+	    cx->cmp = cmp_dbl;
+	    return 1;
+	}
+	*flag = TCELL_DBL;
+	*keyfun = key_dbl;
+	return 0;
+    }
+}
+
+/* Cells of the sort column sharing a heap string share their key */
+typedef struct
+{
+    unsigned int off;
+    size_t key;
+} TSMEMO;
+
+static void
+ts_done(TSCTX *cx)
+{
+    free(cx->keys);
+    free(cx->koff);
+    cx->keys = NULL;
+    cx->koff = NULL;
+}
+
+/*
+** Make the collation keys of the cells of cx->col in the n rows, if
+** the plan compares strings and the collation is not the byte order.
+*/
+static int
+ts_keys(TSCTX *cx,
+	const int *row,
+	int n)
+{
+    TCOLUMN *tcp;
+    TSMEMO *hv = NULL, *hp;
+    const char *s;
+    char *nk;
+    size_t len, size, used, mask;
+    unsigned int off = 0;
+    int i, r;
+
+
+    if ((cx->cmp != cmp_str && cx->cmp != cmp_auto) || !collate_id())
+	return 0;
+
+    tcp = &cx->tp->col[cx->col];
+    for (mask = 1024; mask < 2 * (size_t) n; mask *= 2)
+	;
+    size = 65536;
+    hv = malloc(mask * sizeof(TSMEMO));
+    cx->keys = malloc(size);
+    cx->koff = malloc(cx->tp->nrows * sizeof(size_t));
+    if (!hv || !cx->keys || !cx->koff)
+	goto Fail;
+
+    for (i = 0; i < (int) mask; ++i)
+	hv[i].off = TCELL_NONE;
+    --mask;
+
+    used = 0;
+    for (i = 0; i < n; ++i)
+    {
+	r = row[i];
+	s = ts_cell(cx, r, cx->col);
+	if (!s)
+	    continue;
+
+	/* Row numbers (cell 0) are not in the heap */
+	hp = NULL;
+	if (cx->col > 0)
+	{
+	    off = tcp->off[r];
+	    for (hp = &hv[(off * 2654435761U) & mask];
+		 hp->off != TCELL_NONE && hp->off != off;
+		 hp = &hv[(hp - hv + 1) & mask])
+		;
+	    if (hp->off == off)
+	    {
+		cx->koff[r] = hp->key;
+		continue;
+	    }
+	}
+
+	while ((len = collate_xfrm(cx->keys + used, s, size - used)) >= size - used)
+	{
+	    size = 2 * size + len;
+	    nk = realloc(cx->keys, size);
+	    if (!nk)
+		goto Fail;
+	    cx->keys = nk;
+	}
+
+	cx->koff[r] = used;
+	if (hp)
+	{
+	    hp->off = off;
+	    hp->key = used;
+	}
+	used += len + 1;
+    }
+
+    free(hv);
+    return 0;
+
+  Fail:
+    free(hv);
+    ts_done(cx);
+    return -1;
+}
+
+static void
+ts_reverse(int *row,
+	   int n)
+{
+    int i, t;
+
+
+    for (i = 0; i < n/2; ++i)
+    {
+	t = row[i];
+	row[i] = row[n-1-i];
+	row[n-1-i] = t;
+    }
+}
+
+static int
+ts_init(TSCTX *cx,
+	TABLE *tp,
+	int *row,
+	int n,
+	int col)
+{
+    int i;
+
+
+    cx->tp = tp;
+    cx->col = 0;
+    cx->cmp = NULL;
+    cx->keys = NULL;
+    cx->koff = NULL;
+
+    /* Ties are kept in input order, so start out in row number order */
+    for (i = 1; i < n && ts_rownum(cx, row[i-1]) <= ts_rownum(cx, row[i]); ++i)
+	;
+    if (i < n && ts_sort_keys(cx, row, n, key_rownum) < 0)
+	return -1;
+
+    /* A negative column has always meant the row number */
+    cx->col = (col < 0) ? 0 : col;
+    return 0;
+}
+
+
+/*
+** Sort the n row indices in row[] on column col of tp. The type is
+** that of table_sort(): 1 = auto, 2 = string, 3 = int, 4 = double.
+*/
+int
+tsort_rows(TABLE *tp,
+	   int *row,
+	   int n,
+	   int col,
+	   int type,
+	   int dir)
+{
+    TSCTX cx;
+    uint64_t (*keyfun)(const TSCTX *cx, int r);
+    int k, flag, plan, rc;
+
+
+    if (type < 1 || type > 4)
+	return -1;
+
+    if (n < 2 || tp->cols < 1)
+	return 0;
+
+    if (ts_init(&cx, tp, row, n, col) < 0)
+	return -1;
+
+    plan = ts_plan(&cx, row, n, type, &keyfun, &flag);
+    if (ts_keys(&cx, row, n) < 0)
+	return -1;
+
+    switch (plan)
+    {
+      case 0:
+	k = ts_partition(&cx, row, n, flag);
+	rc = (k < 0) ? -1 : ts_sort_keys(&cx, row + k, n - k, keyfun);
+	break;
+
+      case 1:
+	rc = ts_sort_cmp(&cx, row, n);
+	break;
+
+      default:
+	rc = 0;
+	break;
+    }
+
+    ts_done(&cx);
+    if (rc < 0)
+	return -1;
+
+    if (dir < 0)
+	ts_reverse(row, n);
+
+    return 0;
+}
+
+
+/*
+** Sort all rows of tp into row[0..nrows) in ascending order, for a
+** stored permutation. Returns 1 if the order is a total one on keys,
+** so that it orders any subset of the rows the way tsort_rows()
+** would, 0 if it is not, or -1 on errors.
+*/
+int
+tsort_perm(TABLE *tp,
+	   int *row,
+	   int col,
+	   int type)
+{
+    TSCTX cx;
+    uint64_t (*keyfun)(const TSCTX *cx, int r);
+    int i, k, flag, rc;
+
+
+    if (type < 1 || type > 4)
+	return -1;
+
+    for (i = 0; i < tp->nrows; ++i)
+	row[i] = i;
+
+    if (tp->nrows < 2)
+	return 1;
+    if (tp->cols < 1)
+	return 0;
+
+    if (ts_init(&cx, tp, row, tp->nrows, col) < 0)
+	return -1;
+
+    if (ts_plan(&cx, row, tp->nrows, type, &keyfun, &flag) != 0)
+	return 0;
+    if (ts_keys(&cx, row, tp->nrows) < 0)
+	return -1;
+
+    k = ts_partition(&cx, row, tp->nrows, flag);
+    rc = (k < 0) ? -1 : ts_sort_keys(&cx, row + k, tp->nrows - k, keyfun);
+
+    ts_done(&cx);
+    return (rc < 0) ? -1 : 1;
+}
+
+
+/*
+** Full key of a row for the top-k selection: the partition class,
+** the radix key, and the cell string when that key is only a prefix.
+*/
+typedef struct
+{
+    int cls;
+    int row;
+    uint64_t key;
+    const char *str;
+} TSTOP;
+
+static int
+ts_top_before(const TSCTX *cx,
+	      const TSTOP *a,
+	      const TSTOP *b,
+	      int dir)
+{
+    const TSTOP *t;
+    int d;
+
+
+    if (dir < 0)
+    {
+	t = a;
+	a = b;
+	b = t;
+    }
+
+    if (a->cls != b->cls)
+	return a->cls < b->cls;
+    if (a->key != b->key)
+	return a->key < b->key;
+    if (a->str && b->str && (d = strcmp(a->str, b->str)) != 0)
+	return d < 0;
+
+    return ts_rownum(cx, a->row) < ts_rownum(cx, b->row);
+}
+
+static void
+ts_top_sift(const TSCTX *cx,
+	    TSTOP *hv,
+	    int n,
+	    int i,
+	    int dir)
+{
+    TSTOP t;
+    int c;
+
+
+    /* Max-heap: the root is the row that would be printed last */
+    while ((c = 2*i + 1) < n)
+    {
+	if (c + 1 < n && ts_top_before(cx, &hv[c], &hv[c+1], dir))
+	    ++c;
+	if (!ts_top_before(cx, &hv[i], &hv[c], dir))
+	    break;
+	t = hv[i];
+	hv[i] = hv[c];
+	hv[c] = t;
+	i = c;
+    }
+}
+
+/*
+** Like tsort_rows(), but only the first k rows of the result are
+** wanted. They are selected with a bounded heap, O(n log k), and
+** returned in order in row[0..k). Returns the number of rows kept.
+** Columns that need the comparators are fully sorted.
+*/
+int
+tsort_top(TABLE *tp,
+	  int *row,
+	  int n,
+	  int col,
+	  int type,
+	  int dir,
+	  int k)
+{
+    TSCTX cx;
+    TCOLUMN *tcp;
+    TSTOP *hv, x, t;
+    uint64_t (*keyfun)(const TSCTX *cx, int r);
+    int i, j, h, flag, plan;
+
+
+    if (type < 1 || type > 4)
+	return -1;
+
+    if (k < 0)
+	k = 0;
+    if (k >= n)
+	return tsort_rows(tp, row, n, col, type, dir) < 0 ? -1 : n;
+
+    if (tp->cols < 1)
+	return k;
+
+    if (ts_init(&cx, tp, row, n, col) < 0)
+	return -1;
+
+    plan = ts_plan(&cx, row, n, type, &keyfun, &flag);
+    if (ts_keys(&cx, row, n) < 0)
+	return -1;
+
+    switch (plan)
+    {
+      case 0:
+	break;
+
+      case 1:
+	h = ts_sort_cmp(&cx, row, n);
+	ts_done(&cx);
+	if (h < 0)
+	    return -1;
+	if (dir < 0)
+	    ts_reverse(row, n);
+	return k;
+
+      default:
+	if (dir < 0)
+	    ts_reverse(row, n);
+	return k;
+    }
+
+    if (k == 0)
+    {
+	ts_done(&cx);
+	return 0;
+    }
+
+    hv = malloc(k * sizeof(TSTOP));
+    if (!hv)
+    {
+	ts_done(&cx);
+	return -1;
+    }
+
+    tcp = &tp->col[cx.col];
+    for (i = h = 0; i < n; ++i)
+    {
+	x.row = row[i];
+	x.key = 0;
+	x.str = NULL;
+
+	if (!ts_cell(&cx, x.row, cx.col))
+	    x.cls = TS_MISSING;
+	else if (flag && !(tcp->flags[x.row] & flag))
+	    x.cls = TS_NOVALUE;
+	else
+	{
+	    x.cls = TS_VALUE;
+	    x.key = keyfun(&cx, x.row);
+	    if (cx.cmp == cmp_str)
+		x.str = ts_str(&cx, x.row);
+	}
+
+	if (h < k)
+	{
+	    hv[h++] = x;
+	    if (h == k)
+		for (j = k/2 - 1; j >= 0; --j)
+		    ts_top_sift(&cx, hv, k, j, dir);
+	}
+	else if (ts_top_before(&cx, &x, &hv[0], dir))
+	{
+	    hv[0] = x;
+	    ts_top_sift(&cx, hv, k, 0, dir);
+	}
+    }
+
+    /* Pop the heap from the back, giving the rows in order */
+    for (h = k; h > 1; --h)
+    {
+	t = hv[0];
+	hv[0] = hv[h-1];
+	hv[h-1] = t;
+	ts_top_sift(&cx, hv, h-1, 0, dir);
+    }
+
+    for (i = 0; i < k; ++i)
+	row[i] = hv[i].row;
+
+    free(hv);
+    ts_done(&cx);
+    return k;
+}
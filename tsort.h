@@ -0,0 +1,37 @@
+/*
+** tsort.h
+*/
+
+#ifndef PTMS_TSORT_H
+#define PTMS_TSORT_H
+
+#include "table.h"
+
+/* Inputs at least this large are merge sorted by several threads */
+#define TSORT_PARALLEL_MIN	65536
+#define TSORT_MAX_THREADS	8
+
+extern int
+tsort_rows(TABLE *tp,
+	   int *row,
+	   int n,
+	   int col,
+	   int type,
+	   int dir);
+
+extern int
+tsort_top(TABLE *tp,
+	  int *row,
+	  int n,
+	  int col,
+	  int type,
+	  int dir,
+	  int k);
+
+extern int
+tsort_perm(TABLE *tp,
+	   int *row,
+	   int col,
+	   int type);
+
+#endif
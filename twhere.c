@@ -0,0 +1,624 @@
+/*
+** twhere.c
+**
+** Filter expressions for tables (the where= option of x-table):
+**
+**	expr	= term { ("|" | "or") term }
+**	term	= factor { ("&" | "and") factor }
+**	factor	= "!" factor | "(" expr ")" | column op value
+**	op	= "=" | "!=" | "<" | "<=" | ">" | ">=" | "^=" | "~"
+**
+** A column is a number, as for field=, or a header name. Names and
+** values may be quoted with " or '. "=" takes a range "lo..hi" as
+** well, where either end may be left out. Values that are numbers
+** compare with the numeric value of the cells, dates (yyyy-mm-dd)
+** with cells that are dates, and anything else with the cell string;
+** "^=" is a prefix and "~" a substring match.
+**
+** A row that lacks the cell, or for numbers and dates a value of that
+** kind, makes the condition unknown, as NULL does in SQL: "!" leaves
+** it unknown, "&" is false if either side is and "|" true if either
+** side is, and only rows the whole expression is true for are kept.
+** So "age!=30" and "!(age=30)" both leave out rows with no age.
+**
+** Column 0 is the row number. Tables made of several files number
+** their rows within each file when filtered, so they do not take
+** conditions on it.
+**
+** Expressions are compiled once into a postfix program, which is run
+** a column at a time: each condition is tested for every row into a
+** mask, and the masks are combined.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "table.h"
+#include "twhere.h"
+
+
+#define TW_COND		0
+#define TW_AND		1
+#define TW_OR		2
+#define TW_NOT		3
+
+/* Values of a condition for a row, ordered so "&" is min and "|" max */
+#define TW_FALSE	0
+#define TW_NULL		1
+#define TW_TRUE		2
+
+#define TW_NUM		0
+#define TW_DATE		1
+#define TW_STR		2
+
+typedef struct
+{
+    int op;			/* TW_COND, TW_AND, TW_OR or TW_NOT */
+
+    int col;			/* Column, or -1 for a named one */
+    char *name;
+    int kind;			/* TW_NUM, TW_DATE or TW_STR */
+    char cmp[3];		/* The comparison, for strings */
+    int neg;			/* "!=" */
+    double lo, hi;		/* Numbers and dates: closed range */
+    char *str;
+} TWNODE;
+
+struct TWHERE
+{
+    TWNODE *v;
+    int n;
+    int size;
+};
+
+typedef struct
+{
+    const char *s;
+    TWHERE *wp;
+} TWPARSE;
+
+
+static int tw_expr(TWPARSE *pp);
+
+
+static TWNODE *
+tw_node(TWHERE *wp,
+	int op)
+{
+    TWNODE *nv;
+
+
+    if (wp->n >= wp->size)
+    {
+	nv = realloc(wp->v, (wp->size + 16) * sizeof(TWNODE));
+	if (!nv)
+	    return NULL;
+	wp->v = nv;
+	wp->size += 16;
+    }
+
+    memset(&wp->v[wp->n], 0, sizeof(TWNODE));
+    wp->v[wp->n].op = op;
+    return &wp->v[wp->n++];
+}
+
+static void
+tw_space(TWPARSE *pp)
+{
+    while (isspace((unsigned char) *pp->s))
+	++pp->s;
+}
+
+/* Match the keyword or symbol kw, which words must end after */
+static int
+tw_keyword(TWPARSE *pp,
+	   const char *kw)
+{
+    size_t len = strlen(kw);
+
+
+    tw_space(pp);
+    if (strncasecmp(pp->s, kw, len) != 0)
+	return 0;
+    if (isalpha((unsigned char) *kw) && isalnum((unsigned char) pp->s[len]))
+	return 0;
+
+    pp->s += len;
+    return 1;
+}
+
+/* A name or value: quoted, or up to a space, operator or parenthesis */
+static char *
+tw_word(TWPARSE *pp,
+	const char *stop)
+{
+    const char *start;
+    char *w;
+    int q;
+
+
+    tw_space(pp);
+    if (*pp->s == '"' || *pp->s == '\'')
+    {
+	q = *pp->s++;
+	start = pp->s;
+	while (*pp->s && *pp->s != q)
+	    ++pp->s;
+	if (!*pp->s)
+	    return NULL;
+	w = strndup(start, pp->s - start);
+	++pp->s;
+	return w;
+    }
+
+    start = pp->s;
+    while (*pp->s && !isspace((unsigned char) *pp->s) && !strchr(stop, *pp->s))
+	++pp->s;
+    if (pp->s == start)
+	return NULL;
+
+    return strndup(start, pp->s - start);
+}
+
+/* A whole number, as strtod() reads it */
+static int
+tw_number(const char *s,
+	  double *dp)
+{
+    char *ep;
+
+
+    *dp = strtod(s, &ep);
+    return ep != s && *ep == '\0';
+}
+
+/* A yyyy-mm-dd date, as an ordered number */
+static int
+tw_date(const char *s,
+	double *dp)
+{
+    unsigned int y, m, d;
+    int n = 0;
+
+
+    if (sscanf(s, "%u-%u-%u%n", &y, &m, &d, &n) != 3)
+	return 0;
+    if (dp)
+	*dp = y * 10000.0 + m * 100.0 + d;
+    return s[n] == '\0';
+}
+
+/* Set the range of a numeric or date condition from its values */
+static int
+tw_bounds(TWNODE *np,
+	  const char *op,
+	  const char *lo,
+	  const char *hi)
+{
+    int (*conv)(const char *s, double *dp);
+    double v;
+
+
+    conv = (np->kind == TW_NUM) ? tw_number : tw_date;
+
+    np->lo = -HUGE_VAL;
+    np->hi = HUGE_VAL;
+
+    if (hi)
+    {
+	/* A range, "lo..hi" */
+	if ((*lo && !conv(lo, &np->lo)) || (*hi && !conv(hi, &np->hi)))
+	    return -1;
+	return 0;
+    }
+
+    if (!conv(lo, &v))
+	return -1;
+
+    if (strcmp(op, "<") == 0)
+	np->hi = nextafter(v, -HUGE_VAL);
+    else if (strcmp(op, "<=") == 0)
+	np->hi = v;
+    else if (strcmp(op, ">") == 0)
+	np->lo = nextafter(v, HUGE_VAL);
+    else if (strcmp(op, ">=") == 0)
+	np->lo = v;
+    else
+	np->lo = np->hi = v;
+
+    return 0;
+}
+
+static int
+tw_cond(TWPARSE *pp)
+{
+    static const char *ops[] = { "!=", "<=", ">=", "^=", "=", "<", ">", "~", NULL };
+    TWNODE *np;
+    char *name, *val, *dots;
+    const char *op = NULL;
+    double d;
+    int i;
+
+
+    name = tw_word(pp, "=!<>^~()&|");
+    if (!name)
+	return -1;
+
+    tw_space(pp);
+    for (i = 0; ops[i]; ++i)
+	if (strncmp(pp->s, ops[i], strlen(ops[i])) == 0)
+	{
+	    op = ops[i];
+	    pp->s += strlen(op);
+	    break;
+	}
+
+    val = op ? tw_word(pp, "()&|") : NULL;
+    np = val ? tw_node(pp->wp, TW_COND) : NULL;
+    if (!np)
+    {
+	free(name);
+	free(val);
+	return -1;
+    }
+
+    np->name = name;
+    np->col = -1;
+    if (isdigit((unsigned char) *name) && strspn(name, "0123456789") == strlen(name))
+	np->col = atoi(name);
+    strcpy(np->cmp, op);
+    np->neg = (strcmp(op, "!=") == 0);
+    np->str = val;
+
+    if (strcmp(op, "^=") == 0 || strcmp(op, "~") == 0)
+	np->kind = TW_STR;
+    else if (strcmp(op, "=") == 0 && (dots = strstr(val, "..")) != NULL)
+    {
+	/* A range, numeric or of dates */
+	*dots = '\0';
+	np->kind = ((!*val || tw_number(val, &d)) && (!dots[2] || tw_number(dots+2, &d))) ?
+	    TW_NUM : TW_DATE;
+	return tw_bounds(np, op, val, dots+2);
+    }
+    else if (tw_number(val, &d))
+	np->kind = TW_NUM;
+    else if (tw_date(val, NULL))
+	np->kind = TW_DATE;
+    else
+	np->kind = TW_STR;
+
+    if (np->kind != TW_STR)
+	return tw_bounds(np, op, val, NULL);
+    return 0;
+}
+
+static int
+tw_factor(TWPARSE *pp)
+{
+    if (tw_keyword(pp, "!"))
+    {
+	if (tw_factor(pp) < 0)
+	    return -1;
+	return tw_node(pp->wp, TW_NOT) ? 0 : -1;
+    }
+
+    if (tw_keyword(pp, "("))
+    {
+	if (tw_expr(pp) < 0 || !tw_keyword(pp, ")"))
+	    return -1;
+	return 0;
+    }
+
+    return tw_cond(pp);
+}
+
+static int
+tw_term(TWPARSE *pp)
+{
+    if (tw_factor(pp) < 0)
+	return -1;
+
+    while (tw_keyword(pp, "&") || tw_keyword(pp, "and"))
+	if (tw_factor(pp) < 0 || !tw_node(pp->wp, TW_AND))
+	    return -1;
+
+    return 0;
+}
+
+static int
+tw_expr(TWPARSE *pp)
+{
+    if (tw_term(pp) < 0)
+	return -1;
+
+    while (tw_keyword(pp, "|") || tw_keyword(pp, "or"))
+	if (tw_term(pp) < 0 || !tw_node(pp->wp, TW_OR))
+	    return -1;
+
+    return 0;
+}
+
+
+void
+twhere_free(TWHERE *wp)
+{
+    int i;
+
+
+    if (!wp)
+	return;
+
+    for (i = 0; i < wp->n; ++i)
+    {
+	free(wp->v[i].name);
+	free(wp->v[i].str);
+    }
+    free(wp->v);
+    free(wp);
+}
+
+/*
+** Compile a filter expression. Returns NULL if it is not a valid one.
+*/
+TWHERE *
+twhere_compile(const char *expr)
+{
+    TWPARSE p;
+    TWHERE *wp;
+
+
+    wp = calloc(1, sizeof(*wp));
+    if (!wp)
+	return NULL;
+
+    p.s = expr;
+    p.wp = wp;
+    if (tw_expr(&p) < 0 || (tw_space(&p), *p.s != '\0'))
+    {
+	twhere_free(wp);
+	return NULL;
+    }
+
+    return wp;
+}
+
+/*
+** Have table_load() parse the columns the expression uses. Those
+** given by name are only known after loading, so then all are.
+*/
+int
+twhere_project(TWHERE *wp,
+	       TABLE *tp)
+{
+    int i;
+
+
+    for (i = 0; i < wp->n; ++i)
+	if (wp->v[i].op == TW_COND && wp->v[i].col < 0)
+	    return -1;
+
+    for (i = 0; i < wp->n; ++i)
+	if (wp->v[i].op == TW_COND)
+	    table_project(tp, wp->v[i].col);
+
+    return 0;
+}
+
+
+/* Rows whose numeric value is in [lo, hi], or TW_NULL without one */
+static void
+tw_run_num(const TCOLUMN *tcp,
+	   int n,
+	   double lo,
+	   double hi,
+	   unsigned char *m)
+{
+    const double *dv = tcp->dval;
+    const unsigned char *fv = tcp->flags;
+    int r = 0;
+
+
+#ifdef __SSE2__
+    const __m128d vlo = _mm_set1_pd(lo);
+    const __m128d vhi = _mm_set1_pd(hi);
+    __m128d d;
+    int bits;
+
+
+    for (; r + 2 <= n; r += 2)
+    {
+	d = _mm_loadu_pd(dv + r);
+	bits = _mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(d, vlo), _mm_cmple_pd(d, vhi)));
+	m[r] = (fv[r] & TCELL_DBL) ? (bits & 1) << 1 : TW_NULL;
+	m[r+1] = (fv[r+1] & TCELL_DBL) ? bits & 2 : TW_NULL;
+    }
+#endif
+
+    for (; r < n; ++r)
+	m[r] = !(fv[r] & TCELL_DBL) ? TW_NULL :
+	    (dv[r] >= lo && dv[r] <= hi) ? TW_TRUE : TW_FALSE;
+}
+
+static void
+tw_run_cond(const TWNODE *np,
+	    TABLE *tp,
+	    unsigned char *m)
+{
+    const char *s;
+    double d;
+    int r, c, has;
+    size_t len = strlen(np->str);
+
+
+    if (np->col >= tp->cols)
+    {
+	memset(m, TW_NULL, tp->nrows);
+	return;
+    }
+
+    if (np->kind == TW_NUM)
+    {
+	tw_run_num(&tp->col[np->col], tp->nrows, np->lo, np->hi, m);
+	if (np->neg)
+	    for (r = 0; r < tp->nrows; ++r)
+		m[r] = TW_TRUE - m[r];
+	return;
+    }
+
+    for (r = 0; r < tp->nrows; ++r)
+    {
+	c = np->col;
+	s = TABLE_CELL(tp, r, c);
+	if (!s)
+	{
+	    m[r] = TW_NULL;
+	    continue;
+	}
+
+	if (np->kind == TW_DATE)
+	{
+	    has = tw_date(s, &d);
+	    m[r] = !has ? TW_NULL :
+		((d >= np->lo && d <= np->hi) != np->neg) ? TW_TRUE : TW_FALSE;
+	    continue;
+	}
+
+	switch (np->cmp[0])
+	{
+	  case '^':
+	    m[r] = strncmp(s, np->str, len) == 0;
+	    break;
+	  case '~':
+	    m[r] = strstr(s, np->str) != NULL;
+	    break;
+	  case '!':
+	    m[r] = strcmp(s, np->str) != 0;
+	    break;
+	  case '<':
+	    m[r] = np->cmp[1] ? strcmp(s, np->str) <= 0 : strcmp(s, np->str) < 0;
+	    break;
+	  case '>':
+	    m[r] = np->cmp[1] ? strcmp(s, np->str) >= 0 : strcmp(s, np->str) > 0;
+	    break;
+	  default:
+	    m[r] = strcmp(s, np->str) == 0;
+	    break;
+	}
+	m[r] = m[r] ? TW_TRUE : TW_FALSE;
+    }
+}
+
+/* Find the column of a condition on a named one */
+static int
+tw_bind(TWNODE *np,
+	TABLE *tp)
+{
+    int c;
+
+
+    if (np->col >= 0)
+	return 0;
+
+    for (c = 0; tp->head && c < tp->hcols; ++c)
+	if (strcmp(tp->heap + tp->head[c], np->name) == 0)
+	{
+	    np->col = c;
+	    return 0;
+	}
+
+    return -1;
+}
+
+/*
+** Drop the rows the expression is false for from the view. Returns
+** the number of rows left, or -1 if it names a column the table does
+** not have.
+*/
+int
+twhere_filter(TWHERE *wp,
+	      TABLE *tp)
+{
+    unsigned char **sv, *m;
+    int i, r, k = 0, n = -1;
+
+
+    for (i = 0; i < wp->n; ++i)
+	if (wp->v[i].op == TW_COND && tw_bind(&wp->v[i], tp) < 0)
+	    return -1;
+
+    sv = calloc(wp->n + 1, sizeof(unsigned char *));
+    if (!sv)
+	return -1;
+
+    for (i = 0; i < wp->n; ++i)
+    {
+	switch (wp->v[i].op)
+	{
+	  case TW_COND:
+	    m = sv[k++] = malloc(tp->nrows + 1);
+	    if (!m)
+		goto End;
+	    tw_run_cond(&wp->v[i], tp, m);
+	    break;
+
+	  case TW_NOT:
+	    m = sv[k-1];
+	    for (r = 0; r < tp->nrows; ++r)
+		m[r] = TW_TRUE - m[r];
+	    break;
+
+	  case TW_AND:
+	    m = sv[k-2];
+	    for (r = 0; r < tp->nrows; ++r)
+		if (sv[k-1][r] < m[r])
+		    m[r] = sv[k-1][r];
+	    free(sv[--k]);
+	    break;
+
+	  case TW_OR:
+	    m = sv[k-2];
+	    for (r = 0; r < tp->nrows; ++r)
+		if (sv[k-1][r] > m[r])
+		    m[r] = sv[k-1][r];
+	    free(sv[--k]);
+	    break;
+	}
+    }
+
+    m = sv[0];
+    for (i = n = 0; i < tp->rows; ++i)
+	if (m[tp->row[i]] == TW_TRUE)
+	    tp->row[n++] = tp->row[i];
+    tp->rows = n;
+
+  End:
+    while (k > 0)
+	free(sv[--k]);
+    free(sv);
+    return n;
+}
+
+/*
+** Whether the expression has a condition on column col, once
+** twhere_filter() has found the columns of the names.
+*/
+int
+twhere_uses(TWHERE *wp,
+	    int col)
+{
+    int i;
+
+
+    for (i = 0; i < wp->n; ++i)
+	if (wp->v[i].op == TW_COND && wp->v[i].col == col)
+	    return 1;
+
+    return 0;
+}
@@ -0,0 +1,30 @@
+/*
+** twhere.h
+*/
+
+#ifndef PTMS_TWHERE_H
+#define PTMS_TWHERE_H
+
+#include "table.h"
+
+typedef struct TWHERE TWHERE;
+
+extern TWHERE *
+twhere_compile(const char *expr);
+
+extern int
+twhere_project(TWHERE *wp,
+	       TABLE *tp);
+
+extern int
+twhere_filter(TWHERE *wp,
+	      TABLE *tp);
+
+extern int
+twhere_uses(TWHERE *wp,
+	    int col);
+
+extern void
+twhere_free(TWHERE *wp);
+
+#endif
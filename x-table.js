@@ -0,0 +1,43 @@
+/*
+** x-table.js
+**
+** Optional script for tables made with <!--#x-table ... ajax=1 -->.
+** Sorting by a column header then fetches just that table of the page
+** (?x-fragment=table:N) and swaps it in, instead of loading the whole
+** page again. Include it in the page (or header.html) with
+**
+**	<script src="/x-table.js" defer></script>
+*/
+
+document.addEventListener("click", function (ev) {
+    var a, table, query;
+
+    if (ev.button !== 0 || ev.ctrlKey || ev.metaKey || ev.shiftKey || !ev.target.closest)
+	return;
+
+    a = ev.target.closest("table[data-x-table] a[href^='?']");
+    if (!a)
+	return;
+
+    table = a.closest("table[data-x-table]");
+    query = a.getAttribute("href").slice(1) +
+	"&x-fragment=table:" + table.getAttribute("data-x-table");
+
+    ev.preventDefault();
+    fetch(location.pathname + "?" + query).then(function (r) {
+	if (!r.ok)
+	    throw r;
+	return r.text();
+    }).then(function (html) {
+	var div = document.createElement("div"), t;
+
+	div.innerHTML = html;
+	t = div.querySelector("table");
+	if (!t)
+	    throw html;
+	table.replaceWith(t);
+    }).catch(function () {
+	/* The whole page, as without the script */
+	location.href = a.href;
+    });
+});